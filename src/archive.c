@@ -0,0 +1,237 @@
+/* $Id$ */
+/* Archive of recorded responses for replaying them later
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+/*
+ * Every response is kept in two files named after the sha1 of its url:
+ * <sha1>.hdr with status, validators and time taken, <sha1>.body with
+ * the document itself.
+ */
+
+#include <libxml/xmlmemory.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "archive.h"
+#include "mapfile.h"
+#include "sha1.h"
+#include "global.h"
+
+struct _response
+{
+  /* state variables */
+  long status;
+  char *etag;
+  char *lastmod;
+  double time;			/* seconds taken when recorded */
+  mapfileptr body;
+};
+
+static char *dir = NULL;
+static int mode = ARCHIVE_OFF;
+
+/*
+ * build path of archive file of @url with extension @ext
+ */
+static char *
+url_to_path (const char *url, const char *ext)
+{
+  int i;
+  unsigned char hashval[SHA1_DIGEST_SIZE];
+  char *path, *pos;
+  sha1_buffer (url, strlen (url), hashval);
+  path = (char *) malloc (strlen (dir) + 2 * SHA1_DIGEST_SIZE +
+			  strlen (ext) + 2);
+  pos = path + sprintf (path, "%s/", dir);
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    pos += sprintf (pos, "%02x", hashval[i]);
+  strcpy (pos, ext);
+  return path;
+}
+
+int
+archive_open (const char *d, int m)
+{
+  struct stat st;
+  if (d == NULL || stat (d, &st) != 0 || S_ISDIR (st.st_mode) == 0)
+    {
+      outputf (LVL_ERR, "[archive] %s is no directory\n", d);
+      return RET_ERROR;
+    }
+  archive_close ();
+  dir = strdup (d);
+  mode = m;
+  outputf (LVL_DEBUG, "[archive] Using archive %s for %s\n", dir,
+	   (mode == ARCHIVE_RECORD ? "recording" : "replaying"));
+  return RET_OK;
+}
+
+int
+archive_get_mode (void)
+{
+  return mode;
+}
+
+int
+archive_store (const char *url, long status, const char *etag,
+	       const char *lastmod, double time, const char *data,
+	       size_t size)
+{
+  FILE *f;
+  char *path;
+  int ret = RET_OK;
+  /* write document */
+  path = url_to_path (url, ".body");
+  if ((f = fopen (path, "wb")) == NULL
+      || (size > 0 && fwrite (data, 1, size, f) != size))
+    ret = RET_ERROR;
+  if (f != NULL)
+    fclose (f);
+  free (path);
+  if (ret != RET_OK)
+    {
+      outputf (LVL_WARN, "[archive] Could not record %s\n", url);
+      return RET_ERROR;
+    }
+  /* write status, validators and time */
+  path = url_to_path (url, ".hdr");
+  if ((f = fopen (path, "w")) == NULL)
+    {
+      outputf (LVL_WARN, "[archive] Could not record %s\n", url);
+      free (path);
+      return RET_ERROR;
+    }
+  fprintf (f, "URL: %s\n", url);
+  fprintf (f, "Status: %ld\n", status);
+  fprintf (f, "Time: %.3lf\n", time);
+  if (etag != NULL)
+    fprintf (f, "ETag: %s\n", etag);
+  if (lastmod != NULL)
+    fprintf (f, "Last-Modified: %s\n", lastmod);
+  fclose (f);
+  free (path);
+  outputf (LVL_DEBUG, "[archive] Recorded %s (status %ld, %lu bytes)\n",
+	   url, status, (unsigned long) size);
+  return RET_OK;
+}
+
+responseptr
+archive_load (const char *url)
+{
+  FILE *f;
+  char *path, line[1024];
+  responseptr r;
+  path = url_to_path (url, ".hdr");
+  f = fopen (path, "r");
+  free (path);
+  if (f == NULL)
+    return NULL;
+  /* allocate response struct */
+  r = (responseptr) xmlMalloc (sizeof (response));
+  if (r == NULL)
+    {
+      outputf (LVL_ERR, "[archive] Out of memory\n");
+      fclose (f);
+      return NULL;
+    }
+  /* fill response struct */
+  memset (r, 0, sizeof (response));
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      line[strcspn (line, "\r\n")] = '\0';
+      if (strncmp (line, "Status: ", 8) == 0)
+	r->status = atol (line + 8);
+      else if (strncmp (line, "Time: ", 6) == 0)
+	r->time = atof (line + 6);
+      else if (strncmp (line, "ETag: ", 6) == 0 && r->etag == NULL)
+	r->etag = strdup (line + 6);
+      else if (strncmp (line, "Last-Modified: ", 15) == 0
+	       && r->lastmod == NULL)
+	r->lastmod = strdup (line + 15);
+    }
+  fclose (f);
+  /* empty documents cannot be mapped */
+  path = url_to_path (url, ".body");
+  r->body = mapfile_open (path);
+  free (path);
+  return r;
+}
+
+void
+archive_close (void)
+{
+  if (dir != NULL)
+    free (dir);
+  dir = NULL;
+  mode = ARCHIVE_OFF;
+}
+
+long
+response_get_status (const responseptr r)
+{
+  return r->status;
+}
+
+const char *
+response_get_etag (const responseptr r)
+{
+  return r->etag;
+}
+
+const char *
+response_get_last_modified (const responseptr r)
+{
+  return r->lastmod;
+}
+
+double
+response_get_time (const responseptr r)
+{
+  return r->time;
+}
+
+/*
+ * get recorded document of @r, NULL if empty
+ */
+const char *
+response_get_data (const responseptr r, size_t * size)
+{
+  if (r->body == NULL)
+    {
+      *size = 0;
+      return NULL;
+    }
+  *size = mapfile_get_size (r->body);
+  return mapfile_get_data (r->body);
+}
+
+void
+response_free (responseptr r)
+{
+  if (r == NULL)
+    return;
+  if (r->etag != NULL)
+    free (r->etag);
+  if (r->lastmod != NULL)
+    free (r->lastmod);
+  mapfile_close (r->body);
+  xmlFree (r);
+}
@@ -0,0 +1,51 @@
+/* $Id$ */
+/* Archive of recorded responses for replaying them later
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifndef __WC_ARCHIVE_H__
+#define __WC_ARCHIVE_H__
+
+#include <stddef.h>
+
+/* archive modes */
+#define ARCHIVE_OFF 0
+#define ARCHIVE_RECORD 1
+#define ARCHIVE_REPLAY 2
+
+typedef struct _response response;
+typedef response *responseptr;
+
+/* archive functions */
+int archive_open (const char *dir, int mode);
+int archive_get_mode (void);
+int archive_store (const char *url, long status, const char *etag,
+		   const char *lastmod, double time, const char *data,
+		   size_t size);
+responseptr archive_load (const char *url);
+void archive_close (void);
+
+/* response functions */
+long response_get_status (const responseptr r);
+const char *response_get_etag (const responseptr r);
+const char *response_get_last_modified (const responseptr r);
+double response_get_time (const responseptr r);
+const char *response_get_data (const responseptr r, size_t * size);
+void response_free (responseptr r);
+
+#endif /* __WC_ARCHIVE_H__ */
@@ -0,0 +1,441 @@
+/* $Id$ */
+/* Allocate what belongs to one document from an arena, released at once
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+/*
+ * libxml2 allocates every node, name and string of a tree on its own, and
+ * xmlFreeDoc() hands them back one by one. Once arena_init() has installed
+ * the allocator below, whatever libxml2 allocates while an arena is entered
+ * belongs to that arena and is released along with it by arena_free().
+ * Small blocks are cut from regions of ARENA_REGION bytes; freeing one
+ * only puts it on a list for reuse by its arena. Larger blocks come from
+ * the heap, but are kept track of. Regions are aligned to their size, so
+ * the region of a small block is found by looking up its address rounded
+ * down; everything found neither way is from the heap as usual.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <libxml/xmlmemory.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "global.h"
+
+#define ARENA_REGION 262144	/* bytes, regions are aligned to it */
+#define ARENA_ALIGN 16		/* of blocks, like malloc() */
+#define ARENA_SMALL 1024	/* largest block cut from regions */
+#define ARENA_SLOTS 6		/* initial size of address tables, log2 */
+
+typedef struct _region region;
+typedef region *regionptr;
+
+struct _region
+{
+  regionptr next;		/* regions of same arena */
+  arenaptr owner;
+  void *raw;			/* as allocated, before aligning */
+};
+
+typedef struct _large large;
+typedef large *largeptr;
+
+struct _large
+{
+  largeptr next;		/* large blocks of same arena */
+  largeptr prev;
+  arenaptr owner;
+  size_t size;
+};
+
+struct _arena
+{
+  regionptr regions;
+  largeptr larges;
+  char *pos;			/* free space in current region */
+  char *end;
+  void *freed[ARENA_SMALL / ARENA_ALIGN];	/* small blocks by size */
+  size_t size;			/* bytes taken */
+};
+
+/* table of addresses, open addressing */
+typedef struct _slots slots;
+
+struct _slots
+{
+  size_t *keys;
+  int bits;			/* log2 of size */
+  size_t used;
+};
+
+/* headers of regions, large blocks and small blocks (holding their size) */
+#define HEAD(type) ((sizeof (type) + ARENA_ALIGN - 1) \
+		    & ~(size_t) (ARENA_ALIGN - 1))
+#define BLOCK_HEAD ARENA_ALIGN
+
+static int ready = 0;
+static arenaptr current = NULL;
+static slots region_slots = { NULL, 0, 0 };	/* by their address */
+static slots large_slots = { NULL, 0, 0 };	/* by address of their block */
+
+static size_t
+slot_hash (const slots * s, size_t key)
+{
+  return (size_t) (((unsigned long long) key * 0x9E3779B97F4A7C15ULL)
+		   >> (64 - s->bits));
+}
+
+/*
+ * get slot of @s holding @key, or empty slot to put it into
+ */
+static size_t
+slot_find (const slots * s, size_t key)
+{
+  size_t i = slot_hash (s, key), mask = ((size_t) 1 << s->bits) - 1;
+  while (s->keys[i] != 0 && s->keys[i] != key)
+    i = (i + 1) & mask;
+  return i;
+}
+
+static int
+slot_grow (slots * s)
+{
+  size_t *old = s->keys, count, i;
+  int bits = s->bits;
+  count = (bits != 0 ? (size_t) 1 << bits : 0);
+  s->bits = (bits != 0 ? bits + 1 : ARENA_SLOTS);
+  s->keys = (size_t *) calloc ((size_t) 1 << s->bits, sizeof (size_t));
+  if (s->keys == NULL)
+    {
+      s->keys = old;
+      s->bits = bits;
+      return RET_ERROR;
+    }
+  for (i = 0; i < count; i++)
+    if (old[i] != 0)
+      s->keys[slot_find (s, old[i])] = old[i];
+  free (old);
+  return RET_OK;
+}
+
+static int
+slot_add (slots * s, size_t key)
+{
+  if (2 * (s->used + 1) > ((size_t) 1 << s->bits)
+      && slot_grow (s) != RET_OK)
+    return RET_ERROR;
+  s->keys[slot_find (s, key)] = key;
+  s->used++;
+  return RET_OK;
+}
+
+static int
+slot_has (const slots * s, size_t key)
+{
+  return (s->used != 0 && s->keys[slot_find (s, key)] != 0);
+}
+
+static void
+slot_remove (slots * s, size_t key)
+{
+  size_t i, j, home, mask = ((size_t) 1 << s->bits) - 1;
+  i = slot_find (s, key);
+  if (s->keys[i] == 0)
+    return;
+  s->used--;
+  /* move up what could not be found across the gap otherwise */
+  for (j = (i + 1) & mask; s->keys[j] != 0; j = (j + 1) & mask)
+    {
+      home = slot_hash (s, s->keys[j]);
+      if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+	continue;
+      s->keys[i] = s->keys[j];
+      i = j;
+    }
+  s->keys[i] = 0;
+}
+
+/*
+ * get region of block @mem, NULL if it is not a small one of an arena
+ */
+static regionptr
+region_of (const void *mem)
+{
+  size_t base = (size_t) mem & ~(size_t) (ARENA_REGION - 1);
+  return (slot_has (&region_slots, base) ? (regionptr) base : NULL);
+}
+
+static int
+region_new (arenaptr a)
+{
+  void *raw, *base;
+  regionptr r;
+#ifdef HAVE_POSIX_MEMALIGN
+  if (posix_memalign (&raw, ARENA_REGION, ARENA_REGION) != 0)
+    return RET_ERROR;
+  base = raw;
+#else
+  /* align by hand, wasting up to one region */
+  if ((raw = malloc (2 * ARENA_REGION)) == NULL)
+    return RET_ERROR;
+  base = (void *) (((size_t) raw + ARENA_REGION - 1)
+		   & ~(size_t) (ARENA_REGION - 1));
+#endif
+  if (slot_add (&region_slots, (size_t) base) != RET_OK)
+    {
+      free (raw);
+      return RET_ERROR;
+    }
+  r = (regionptr) base;
+  r->owner = a;
+  r->raw = raw;
+  r->next = a->regions;
+  a->regions = r;
+  a->pos = (char *) r + HEAD (region);
+  a->end = (char *) r + ARENA_REGION;
+  a->size += ARENA_REGION;
+  return RET_OK;
+}
+
+static void *
+large_new (arenaptr a, size_t size)
+{
+  largeptr l;
+  if (size > ((size_t) -1) - HEAD (large)
+      || (l = (largeptr) malloc (HEAD (large) + size)) == NULL)
+    return NULL;
+  if (slot_add (&large_slots, (size_t) l + HEAD (large)) != RET_OK)
+    {
+      free (l);
+      return NULL;
+    }
+  l->owner = a;
+  l->size = size;
+  l->prev = NULL;
+  if ((l->next = a->larges) != NULL)
+    l->next->prev = l;
+  a->larges = l;
+  a->size += size;
+  return (char *) l + HEAD (large);
+}
+
+static void
+large_free (largeptr l)
+{
+  arenaptr a = l->owner;
+  if (l->prev != NULL)
+    l->prev->next = l->next;
+  else
+    a->larges = l->next;
+  if (l->next != NULL)
+    l->next->prev = l->prev;
+  a->size -= l->size;
+  slot_remove (&large_slots, (size_t) l + HEAD (large));
+  free (l);
+}
+
+static size_t
+block_size (const void *mem)
+{
+  return *(const size_t *) ((const char *) mem - BLOCK_HEAD);
+}
+
+static void *
+block_new (arenaptr a, size_t size)
+{
+  char *mem;
+  size_t i;
+  if (size > ARENA_SMALL)
+    return large_new (a, size);
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (size == 0)
+    size = ARENA_ALIGN;
+  /* reuse freed block of same size */
+  i = size / ARENA_ALIGN - 1;
+  if ((mem = (char *) a->freed[i]) != NULL)
+    {
+      a->freed[i] = *(void **) mem;
+      return mem;
+    }
+  if ((size_t) (a->end - a->pos) < BLOCK_HEAD + size
+      && region_new (a) != RET_OK)
+    return NULL;
+  mem = a->pos + BLOCK_HEAD;
+  *(size_t *) a->pos = size;
+  a->pos = mem + size;
+  return mem;
+}
+
+static void *
+hook_malloc (size_t size)
+{
+  if (current == NULL)
+    return malloc (size);
+  return block_new (current, size);
+}
+
+static void
+hook_free (void *mem)
+{
+  regionptr r;
+  size_t i;
+  if (mem == NULL)
+    return;
+  if ((r = region_of (mem)) != NULL)
+    {
+      /* small blocks stay with their arena */
+      i = block_size (mem) / ARENA_ALIGN - 1;
+      *(void **) mem = r->owner->freed[i];
+      r->owner->freed[i] = mem;
+    }
+  else if (slot_has (&large_slots, (size_t) mem))
+    large_free ((largeptr) ((char *) mem - HEAD (large)));
+  else
+    free (mem);
+}
+
+static void *
+hook_realloc (void *mem, size_t size)
+{
+  regionptr r;
+  largeptr l, prev, next;
+  void *copy;
+  if (mem == NULL)
+    return hook_malloc (size);
+  /* blocks stay where they are from, arena or heap */
+  if ((r = region_of (mem)) != NULL)
+    {
+      if (size <= block_size (mem))
+	return mem;
+      if ((copy = block_new (r->owner, size)) == NULL)
+	return NULL;
+      memcpy (copy, mem, block_size (mem));
+      hook_free (mem);
+      return copy;
+    }
+  if (slot_has (&large_slots, (size_t) mem) == 0)
+    return realloc (mem, size);
+  l = (largeptr) ((char *) mem - HEAD (large));
+  if (size > ((size_t) -1) - HEAD (large))
+    return NULL;
+  /* listed anew where it moves to, which never needs more slots */
+  prev = l->prev;
+  next = l->next;
+  slot_remove (&large_slots, (size_t) mem);
+  if ((copy = realloc (l, HEAD (large) + size)) == NULL)
+    {
+      slot_add (&large_slots, (size_t) mem);
+      return NULL;
+    }
+  l = (largeptr) copy;
+  l->owner->size += size - l->size;
+  l->size = size;
+  if (prev != NULL)
+    prev->next = l;
+  else
+    l->owner->larges = l;
+  if (next != NULL)
+    next->prev = l;
+  mem = (char *) l + HEAD (large);
+  slot_add (&large_slots, (size_t) mem);
+  return mem;
+}
+
+static char *
+hook_strdup (const char *str)
+{
+  size_t len = strlen (str) + 1;
+  char *copy = (char *) hook_malloc (len);
+  if (copy != NULL)
+    memcpy (copy, str, len);
+  return copy;
+}
+
+/*
+ * let libxml2 allocate from arenas; call before anything else of libxml2,
+ * without it arena_new() fails and everything comes from the heap
+ */
+int
+arena_init (void)
+{
+  if (ready == 0
+      && xmlMemSetup (hook_free, hook_malloc, hook_realloc, hook_strdup) == 0)
+    ready = 1;
+  return (ready != 0 ? RET_OK : RET_ERROR);
+}
+
+arenaptr
+arena_new (void)
+{
+  arenaptr a;
+  if (ready == 0)
+    return NULL;
+  /* bookkeeping never lives in an arena itself */
+  if ((a = (arenaptr) malloc (sizeof (arena))) == NULL)
+    {
+      outputf (LVL_ERR, "[arena] Out of memory\n");
+      return NULL;
+    }
+  memset (a, 0, sizeof (arena));
+  return a;
+}
+
+/*
+ * release everything allocated from @a at once
+ */
+void
+arena_free (arenaptr a)
+{
+  regionptr r;
+  if (a == NULL)
+    return;
+  if (current == a)
+    current = NULL;
+  while (a->larges != NULL)
+    large_free (a->larges);
+  while ((r = a->regions) != NULL)
+    {
+      a->regions = r->next;
+      slot_remove (&region_slots, (size_t) r);
+      free (r->raw);
+    }
+  free (a);
+}
+
+/*
+ * make libxml2 allocate from @a (from the heap, if NULL) until entering
+ * another arena; returns the one entered before
+ */
+arenaptr
+arena_enter (arenaptr a)
+{
+  arenaptr prev = current;
+  current = a;
+  return prev;
+}
+
+/*
+ * get bytes taken by @a
+ */
+size_t
+arena_get_size (const arenaptr a)
+{
+  return (a != NULL ? a->size : 0);
+}
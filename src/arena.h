@@ -0,0 +1,36 @@
+/* $Id$ */
+/* Allocate what belongs to one document from an arena, released at once
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifndef __WC_ARENA_H__
+#define __WC_ARENA_H__
+
+#include <stddef.h>
+
+typedef struct _arena arena;
+typedef arena *arenaptr;
+
+/* arena functions */
+int arena_init (void);
+arenaptr arena_new (void);
+void arena_free (arenaptr a);
+arenaptr arena_enter (arenaptr a);
+size_t arena_get_size (const arenaptr a);
+
+#endif /* __WC_ARENA_H__ */
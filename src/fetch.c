@@ -0,0 +1,1598 @@
+/* $Id$ */
+/* Fetch documents, concurrently if possible
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <libxml/HTMLparser.h>
+#include <libxml/xpath.h>
+#include <libxml/SAX2.h>
+#include <libxml/xmlIO.h>
+#include <libxml/hash.h>
+#include <libxml/list.h>
+#include <libxml/uri.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef HAVE_LIBCURL
+#include <curl/curl.h>
+#endif
+#include "global.h"
+#include "fetch.h"
+#include "host.h"
+#include "sha1.h"
+#include "mapfile.h"
+#include "archive.h"
+
+static int concurrency = FETCH_DEFAULT_CONCURRENCY;
+static int mode = 0;
+static int connect_timeout = FETCH_DEFAULT_CONNECT_TIMEOUT;
+static int total_timeout = FETCH_DEFAULT_TIMEOUT;
+static long latency = -1;	/* simulated link of replays, in ms, -1 = as
+				   recorded */
+static long bandwidth = 0;	/* in bytes/s, 0 = unlimited */
+static size_t budget = (size_t) FETCH_DEFAULT_BUDGET << 20;
+static size_t inmemory = 0;	/* bytes of documents and trees in memory */
+
+typedef enum
+{
+  FS_QUEUED = 0,
+  FS_RUNNING,
+  FS_DONE,
+  FS_FAILED
+} fstate;
+
+struct _transfer
+{
+  /* user-filled variables */
+  char *url;
+  char *condetag;		/* validators of cached version */
+  char *condlastmod;
+  char *condsha1;		/* fingerprint of cached version */
+  char *cache;			/* path of cached version */
+  long maxbytes;		/* cut document off after that many bytes */
+  char *until;			/* or after closing tag of that element */
+  int options;			/* of HTML parser, for tree of first user */
+  /* state variables */
+  xmlParserInputBufferPtr buf;
+  mapfileptr map;		/* local document */
+  htmlParserCtxtPtr ctxt;
+  xmlDocPtr doc;
+  size_t tree;			/* estimated bytes of doc (or ctxt's) */
+  xmlCharEncoding enc;		/* of fetched version, as told by mapfile */
+  long status;			/* HTTP response code */
+  char *etag;			/* validators of fetched version */
+  char *lastmod;
+  struct sha1_ctx sha;		/* fingerprint of fetched version */
+  char sha1[2 * SHA1_DIGEST_SIZE + 1];
+  fstate state;
+  char *key;			/* in fetch memo */
+  int refs;			/* users of document */
+  int users;			/* users announced by fetch_queue() to come */
+  size_t received;
+  size_t cut;			/* length of document cut off early, or 0 */
+#ifdef HAVE_LIBCURL
+  int mode;
+  hostptr host;
+  int tries;			/* retries so far */
+  double notbefore;		/* earliest time (in ms) of next try */
+  CURL *curl;
+  struct curl_slist *headers;
+  mapfileptr old;		/* cached version, while document equals it */
+  size_t kept;			/* bytes of document kept in memory */
+  FILE *spool;			/* or spooled to this file */
+  char *spoolname;
+#endif
+};
+
+/* all transfers of this run (the fetch memo), by memo key */
+static xmlHashTablePtr transfers = NULL;
+
+/*
+ * complete fingerprint of fetched document of @t
+ */
+static void
+finish_sha1 (transferptr t)
+{
+  int i;
+  unsigned char digest[SHA1_DIGEST_SIZE];
+  sha1_finish_ctx (&t->sha, digest);
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    sprintf (t->sha1 + 2 * i, "%02x", digest[i]);
+}
+
+/*
+ * fingerprint document of @t at once, cutting it off after its byte limit
+ */
+static void
+fingerprint_content (transferptr t)
+{
+  const char *data;
+  size_t size;
+  data = transfer_get_content (t, &size);
+  if (t->maxbytes > 0 && size > (size_t) t->maxbytes)
+    size = t->cut = t->maxbytes;
+  sha1_init_ctx (&t->sha);
+  sha1_process_bytes (data, size, &t->sha);
+  finish_sha1 (t);
+}
+
+/*
+ * get path of local file @url refers to, NULL if it is no local file
+ */
+static char *
+local_path (const char *url)
+{
+  struct stat st;
+  if (strncasecmp (url, "file://", 7) == 0)
+    {
+      url += 7;
+      if (strncasecmp (url, "localhost/", 10) == 0)
+	url += 9;
+      return xmlURIUnescapeString (url, 0, NULL);
+    }
+  if (strstr (url, "://") == NULL && stat (url, &st) == 0)
+    return (char *) xmlStrdup (BAD_CAST url);
+  return NULL;
+}
+
+/*
+ * build memo key of @url: the url, normalized (lowercase scheme and host,
+ * no default port, no fragment), the validators of the cached version
+ * (the answer to a conditional request only suits its validators) and the
+ * cut-off point; users with other parser options share the document, but
+ * not its tree
+ */
+static char *
+memo_key (const char *url, const char *etag, const char *lastmod,
+	  long maxbytes, const char *until)
+{
+  xmlURIPtr uri;
+  xmlChar *norm = NULL;
+  char *key, *pos;
+  if ((uri = xmlParseURI (url)) != NULL)
+    {
+      if (uri->scheme != NULL)
+	for (pos = uri->scheme; *pos != '\0'; pos++)
+	  *pos = tolower ((unsigned char) *pos);
+      if (uri->server != NULL)
+	for (pos = uri->server; *pos != '\0'; pos++)
+	  *pos = tolower ((unsigned char) *pos);
+      if (uri->scheme != NULL
+	  && ((uri->port == 80 && strcmp (uri->scheme, "http") == 0)
+	      || (uri->port == 443 && strcmp (uri->scheme, "https") == 0)))
+	uri->port = 0;
+      if (uri->fragment != NULL)
+	xmlFree (uri->fragment);
+      uri->fragment = NULL;
+      if (uri->server != NULL && uri->path == NULL)
+	uri->path = (char *) xmlStrdup (BAD_CAST "/");
+      norm = xmlSaveUri (uri);
+      xmlFreeURI (uri);
+    }
+  if (norm == NULL)
+    norm = xmlStrdup (BAD_CAST url);
+  key = (char *) malloc (xmlStrlen (norm) + (etag ? strlen (etag) : 0)
+			 + (lastmod ? strlen (lastmod) : 0)
+			 + (until ? strlen (until) : 0) + 26);
+  sprintf (key, "%s\n%s\n%s\n%ld\n%s", (char *) norm, (etag ? etag : ""),
+	   (lastmod ? lastmod : ""), maxbytes, (until ? until : ""));
+  xmlFree (norm);
+  return key;
+}
+
+/*
+ * free tree of @t, parsed while fetching or for a user
+ */
+static void
+tree_free (transferptr t)
+{
+  if (t->ctxt != NULL)
+    {
+      if (t->ctxt->myDoc != NULL)
+	xmlFreeDoc (t->ctxt->myDoc);
+      htmlFreeParserCtxt (t->ctxt);
+    }
+  t->ctxt = NULL;
+  if (t->doc != NULL)
+    xmlFreeDoc (t->doc);
+  t->doc = NULL;
+  inmemory -= t->tree;
+  t->tree = 0;
+}
+
+#ifdef HAVE_LIBCURL
+static CURLM *multi = NULL;
+static CURLSH *share = NULL;	/* dns, tls sessions, connections */
+static xmlListPtr handles = NULL;	/* idle curl handles for reuse */
+static xmlListPtr delayed = NULL;	/* transfers waiting for a retry */
+static xmlListPtr replays = NULL;	/* replayed transfers not yet due */
+static int queued = 0;		/* transfers waiting in host queues */
+
+static double
+now_ms (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static void
+pause_ms (double ms)
+{
+  if (ms <= 0)
+    return;
+#ifdef _WIN32
+  Sleep ((DWORD) ms);
+#else
+  usleep ((useconds_t) (ms * 1000));
+#endif
+}
+
+/*
+ * SAX handler of closing tags, which stops parsing (and fetching) right
+ * after the first closing tag of the element the document is cut off at
+ */
+static void
+cutoff_end_element (void *ctx, const xmlChar * name)
+{
+  htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr) ctx;
+  transferptr t = (transferptr) ctxt->_private;
+  long pos;
+  xmlSAX2EndElement (ctx, name);
+  if (t->cut != 0 || xmlStrcasecmp (name, BAD_CAST t->until) != 0)
+    return;
+  pos = xmlByteConsumed (ctxt);
+  t->cut = (pos > 0 ? (size_t) pos : t->received);
+  xmlStopParser (ctxt);
+}
+
+/*
+ * free document of @t kept in memory
+ */
+static void
+buffer_free (transferptr t)
+{
+  if (t->buf != NULL)
+    xmlFreeParserInputBuffer (t->buf);
+  t->buf = NULL;
+  inmemory -= t->kept;
+  t->kept = 0;
+}
+
+/*
+ * close spool file of @t, mapping it as document of @t if @keep != 0
+ */
+static int
+spool_close (transferptr t, int keep)
+{
+  int ret = RET_OK;
+  if (t->spool == NULL)
+    return RET_OK;
+  if (fclose (t->spool) != 0)
+    ret = RET_ERROR;
+  t->spool = NULL;
+  if (keep != 0 && ret == RET_OK
+      && (t->map = mapfile_open (t->spoolname)) == NULL)
+    ret = RET_ERROR;
+  /* mapping outlives its file */
+  remove (t->spoolname);
+  free (t->spoolname);
+  t->spoolname = NULL;
+  return ret;
+}
+
+/*
+ * move document of @t from memory to a spool file, it is mapped from
+ * there once complete
+ */
+static int
+spool_open (transferptr t)
+{
+  size_t size;
+#ifdef _WIN32
+  if ((t->spoolname = _tempnam (NULL, "wc")) == NULL
+      || (t->spool = fopen (t->spoolname, "w+b")) == NULL)
+    return RET_ERROR;
+#else
+  const char *dir;
+  int fd;
+  if ((dir = getenv ("TMPDIR")) == NULL)
+    dir = "/tmp";
+  t->spoolname = (char *) malloc (strlen (dir) + 20);
+  sprintf (t->spoolname, "%s/webchangesXXXXXX", dir);
+  if ((fd = mkstemp (t->spoolname)) < 0
+      || (t->spool = fdopen (fd, "w+b")) == NULL)
+    {
+      outputf (LVL_WARN, "[fetch] Could not create %s\n", t->spoolname);
+      free (t->spoolname);
+      t->spoolname = NULL;
+      return RET_ERROR;
+    }
+#endif
+  outputf (LVL_DEBUG, "[fetch] Spooling %s to %s\n", t->url, t->spoolname);
+  size = t->kept;
+  if (size > 0 && fwrite (xmlBufferContent (t->buf->buffer), 1, size,
+			  t->spool) != size)
+    return RET_ERROR;
+  buffer_free (t);
+  /* parse from mapping later, unless parser determines cut-off point */
+  if (t->until == NULL)
+    {
+      tree_free (t);
+      mapfile_close (t->old);
+      t->old = NULL;
+      t->mode &= ~FETCH_PARSE;
+    }
+  return RET_OK;
+}
+
+/*
+ * parse chunk @data of @len bytes of document of @t
+ */
+static int
+parse_chunk (transferptr t, const char *data, size_t len)
+{
+  /* trees count against the budget as well, a document whose tree would
+     exceed it is parsed later (unless the parser determines where to cut
+     it off) */
+  if (t->until == NULL && budget > 0
+      && inmemory + len * FETCH_TREE_WEIGHT > budget)
+    {
+      outputf (LVL_DEBUG, "[fetch] Parsing %s later, budget exceeded\n",
+	       t->url);
+      tree_free (t);
+      t->mode &= ~FETCH_PARSE;
+      return RET_OK;
+    }
+  t->tree += len * FETCH_TREE_WEIGHT;
+  inmemory += len * FETCH_TREE_WEIGHT;
+  if (t->ctxt == NULL)
+    {
+      /* first chunk also determines encoding */
+      t->ctxt = htmlCreatePushParserCtxt (NULL, NULL, data, len, t->url,
+					  XML_CHAR_ENCODING_NONE);
+      if (t->ctxt == NULL)
+	return RET_ERROR;
+      htmlCtxtUseOptions (t->ctxt, t->options);
+      mapfile_prepare (t->ctxt);
+      t->ctxt->_private = t;
+      if (t->until != NULL)
+	t->ctxt->sax->endElement = cutoff_end_element;
+    }
+  else
+    htmlParseChunk (t->ctxt, data, len, 0);
+  return RET_OK;
+}
+
+/*
+ * compare chunk @data of @len bytes of document of @t to its cached
+ * version, parsing starts with the first difference, catching up on the
+ * part received before (which equals the cached version)
+ */
+static int
+compare_chunk (transferptr t, const char *data, size_t len)
+{
+  size_t pos = t->received - len;
+  if (t->old == NULL || (pos + len <= mapfile_get_size (t->old)
+			 && memcmp (mapfile_get_data (t->old) + pos, data,
+				    len) == 0))
+    return RET_OK;
+  outputf (LVL_DEBUG, "[fetch] %s differs from cached version at %lu\n",
+	   t->url, (unsigned long) pos);
+  t->mode |= FETCH_PARSE;
+  if (pos > 0 && parse_chunk (t, mapfile_get_data (t->old), pos) != RET_OK)
+    return RET_ERROR;
+  mapfile_close (t->old);
+  t->old = NULL;
+  return RET_OK;
+}
+
+static size_t
+curl2libxml_writer (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+  transferptr t = (transferptr) stream;
+  size_t len = size * nmemb;
+  if (t == NULL)
+    return -1;
+  /* ignore everything beyond byte limit */
+  if (t->maxbytes > 0 && t->received + len >= (size_t) t->maxbytes)
+    {
+      len = t->maxbytes - t->received;
+      t->cut = t->maxbytes;
+    }
+  t->received += len;
+  sha1_process_bytes (ptr, len, &t->sha);
+  /* keep document in memory for all users, unless documents in memory
+     would exceed budget */
+  if (t->spool == NULL && budget > 0 && inmemory + len > budget
+      && spool_open (t) != RET_OK)
+    return -1;
+  if (t->spool != NULL)
+    {
+      if (fwrite (ptr, 1, len, t->spool) != len)
+	return -1;
+    }
+  else
+    {
+      if (xmlParserInputBufferPush (t->buf, len, (const char *) ptr) < 0)
+	return -1;
+      t->kept += len;
+      inmemory += len;
+    }
+  if (compare_chunk (t, (const char *) ptr, len) != RET_OK)
+    return -1;
+  /* parse document while fetching */
+  if ((t->mode & FETCH_PARSE) != 0
+      && parse_chunk (t, (const char *) ptr, len) != RET_OK)
+    return -1;
+  /* abort transfer once the document is cut off */
+  if (t->cut != 0)
+    return 0;
+  return size * nmemb;
+}
+
+/*
+ * return value of header line @line, if it is a @name header
+ */
+static char *
+header_value (const char *line, size_t len, const char *name)
+{
+  char *val;
+  size_t n = strlen (name);
+  if (len <= n || line[n] != ':' || strncasecmp (line, name, n) != 0)
+    return NULL;
+  line += n + 1;
+  len -= n + 1;
+  /* strip surrounding whitespace */
+  while (len > 0 && (*line == ' ' || *line == '\t'))
+    {
+      line++;
+      len--;
+    }
+  while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == '\n'
+		     || line[len - 1] == ' ' || line[len - 1] == '\t'))
+    len--;
+  val = (char *) malloc (len + 1);
+  memcpy (val, line, len);
+  val[len] = '\0';
+  return val;
+}
+
+static size_t
+header_writer (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+  transferptr t = (transferptr) stream;
+  const char *line = (const char *) ptr;
+  size_t len = size * nmemb;
+  char *val;
+  if (len >= 5 && strncmp (line, "HTTP/", 5) == 0)
+    {
+      /* status line of a new response, forget previous headers */
+      if (t->etag != NULL)
+	free (t->etag);
+      if (t->lastmod != NULL)
+	free (t->lastmod);
+      t->etag = t->lastmod = NULL;
+    }
+  else if ((val = header_value (line, len, "ETag")) != NULL)
+    {
+      if (t->etag != NULL)
+	free (t->etag);
+      t->etag = val;
+    }
+  else if ((val = header_value (line, len, "Last-Modified")) != NULL)
+    {
+      if (t->lastmod != NULL)
+	free (t->lastmod);
+      t->lastmod = val;
+    }
+  return len;
+}
+
+/*
+ * get an idle curl handle or create a new one, sharing our caches
+ */
+static CURL *
+handle_get (void)
+{
+  CURL *curl;
+  if (xmlListEmpty (handles) == 0)
+    {
+      curl = (CURL *) xmlLinkGetData (xmlListFront (handles));
+      xmlListPopFront (handles);
+      /* keeps connections and caches of @curl */
+      curl_easy_reset (curl);
+    }
+  else if ((curl = curl_easy_init ()) == NULL)
+    return NULL;
+  curl_easy_setopt (curl, CURLOPT_SHARE, share);
+  return curl;
+}
+
+/*
+ * keep curl handle @curl for reuse, at most one per concurrent transfer
+ */
+static void
+handle_put (CURL * curl)
+{
+  if (curl == NULL)
+    return;
+  if (xmlListSize (handles) < concurrency)
+    xmlListPushBack (handles, curl);
+  else
+    curl_easy_cleanup (curl);
+}
+
+static int
+handle_cleanup_walker (const void *data, void *user)
+{
+  curl_easy_cleanup ((CURL *) data);
+  return 1;
+}
+
+static struct curl_slist *
+append_header (struct curl_slist *headers, const char *name,
+	       const char *val)
+{
+  char *line;
+  line = (char *) malloc (strlen (name) + 2 + strlen (val) + 1);
+  sprintf (line, "%s: %s", name, val);
+  headers = curl_slist_append (headers, line);
+  free (line);
+  return headers;
+}
+
+/*
+ * prepare buffer and parsing of transfer @t
+ */
+static void
+transfer_prepare (transferptr t)
+{
+  t->mode = mode;
+  /* a document with a cached version is probably unchanged, so it is
+     only parsed while fetching from where it differs, if at all (an
+     unchanged one is not parsed at all); unless the parser determines
+     where to cut the document off */
+  if (t->until != NULL)
+    t->mode |= FETCH_PARSE;
+  else if ((t->mode & FETCH_PARSE) != 0 && t->condsha1 != NULL
+	   && (t->old = mapfile_open (t->cache)) != NULL)
+    t->mode &= ~FETCH_PARSE;
+  t->received = t->cut = 0;
+  sha1_init_ctx (&t->sha);
+  t->buf = xmlAllocParserInputBuffer (XML_CHAR_ENCODING_NONE);
+}
+
+/*
+ * prepare curl handle and buffer of transfer @t
+ */
+static int
+transfer_start (transferptr t)
+{
+  if ((t->curl = handle_get ()) == NULL)
+    {
+      outputf (LVL_ERR, "[fetch] Unable to initialize curl\n");
+      return RET_ERROR;
+    }
+  transfer_prepare (t);
+  curl_easy_setopt (t->curl, CURLOPT_NOPROGRESS, 1);
+  curl_easy_setopt (t->curl, CURLOPT_WRITEFUNCTION, &curl2libxml_writer);
+  curl_easy_setopt (t->curl, CURLOPT_WRITEDATA, t);
+  curl_easy_setopt (t->curl, CURLOPT_HEADERFUNCTION, &header_writer);
+  curl_easy_setopt (t->curl, CURLOPT_HEADERDATA, t);
+  curl_easy_setopt (t->curl, CURLOPT_PRIVATE, t);
+  curl_easy_setopt (t->curl, CURLOPT_URL, t->url);
+  /* give up on unreachable, slow or stalled servers */
+  curl_easy_setopt (t->curl, CURLOPT_CONNECTTIMEOUT, (long) connect_timeout);
+  curl_easy_setopt (t->curl, CURLOPT_TIMEOUT, (long) total_timeout);
+  curl_easy_setopt (t->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt (t->curl, CURLOPT_LOW_SPEED_TIME,
+		    (long) FETCH_LOW_SPEED_TIME);
+  /* negotiate HTTP/2 with https servers, plain http stays HTTP/1.1 */
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  curl_easy_setopt (t->curl, CURLOPT_HTTP_VERSION,
+		    (long) CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  /* rather wait for a connection to multiplex on than open another one */
+  curl_easy_setopt (t->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+  /* accept all compressions supported by libcurl (gzip, deflate, brotli,
+     zstd), which decodes them before passing data to our writer */
+#if LIBCURL_VERSION_NUM >= 0x071506
+  curl_easy_setopt (t->curl, CURLOPT_ACCEPT_ENCODING, "");
+#else
+  curl_easy_setopt (t->curl, CURLOPT_ENCODING, "");
+#endif
+  /* ask for the document only if it differs from the cached version
+     (recordings always contain the document) */
+  if (t->condetag != NULL && archive_get_mode () != ARCHIVE_RECORD)
+    t->headers = append_header (t->headers, "If-None-Match", t->condetag);
+  if (t->condlastmod != NULL && archive_get_mode () != ARCHIVE_RECORD)
+    t->headers = append_header (t->headers, "If-Modified-Since",
+				t->condlastmod);
+  if (t->headers != NULL)
+    curl_easy_setopt (t->curl, CURLOPT_HTTPHEADER, t->headers);
+  t->state = FS_RUNNING;
+  return RET_OK;
+}
+
+/*
+ * get result of transfer @t, which completed with @res; having aborted it
+ * at its cut-off point is no failure
+ */
+static CURLcode
+transfer_result (transferptr t, CURLcode res)
+{
+  if (res == CURLE_WRITE_ERROR && t->cut != 0)
+    {
+      outputf (LVL_DEBUG, "[fetch] Cut %s off after %lu bytes\n", t->url,
+	       (unsigned long) t->cut);
+      return CURLE_OK;
+    }
+  return res;
+}
+
+/*
+ * check if failure @res (or HTTP status @status) may vanish on retry
+ */
+static int
+is_transient (CURLcode res, long status)
+{
+  switch (res)
+    {
+    case CURLE_OK:
+      return (status == 429 || status == 502 || status == 503
+	      || status == 504);
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+/*
+ * schedule transfer @t, which completed with @res, for another try if
+ * its failure is transient; the delay grows exponentially with jitter
+ */
+static int
+transfer_retry (transferptr t, CURLcode res)
+{
+  long status = 0;
+  double delay;
+  int failures;
+  time_t until;
+  if (t->curl != NULL)
+    curl_easy_getinfo (t->curl, CURLINFO_RESPONSE_CODE, &status);
+  if (t->tries >= FETCH_RETRIES || is_transient (res, status) == 0)
+    return RET_ERROR;
+  /* a host, whose breaker is open, gets no more tries */
+  host_get_breaker (t->host, &failures, &until);
+  if (failures >= HOST_BREAKER_FAILURES)
+    return RET_ERROR;
+  delay = (double) (FETCH_BACKOFF << t->tries++);
+  delay = delay / 2 + delay * rand () / RAND_MAX;
+  outputf (LVL_INFO, "[fetch] Retrying %s in %.0lf ms (%s)\n", t->url,
+	   delay, (res != CURLE_OK ? curl_easy_strerror (res) : "busy"));
+  /* forget everything about this try */
+  handle_put (t->curl);
+  t->curl = NULL;
+  if (t->headers != NULL)
+    curl_slist_free_all (t->headers);
+  t->headers = NULL;
+  tree_free (t);
+  mapfile_close (t->old);
+  t->old = NULL;
+  buffer_free (t);
+  spool_close (t, 0);
+  if (t->etag != NULL)
+    free (t->etag);
+  if (t->lastmod != NULL)
+    free (t->lastmod);
+  t->etag = t->lastmod = NULL;
+  t->enc = XML_CHAR_ENCODING_ERROR;
+  t->notbefore = now_ms () + delay;
+  t->state = FS_QUEUED;
+  return RET_OK;
+}
+
+/*
+ * tell whether fetched document of @t starts with a UTF-8 byte order mark
+ */
+static int
+has_bom (transferptr t)
+{
+  const char *data;
+  size_t size;
+  data = transfer_get_content (t, &size);
+  return (data != NULL && size >= 3
+	  && memcmp (data, "\xef\xbb\xbf", 3) == 0);
+}
+
+/*
+ * release curl handle of transfer @t, which completed with @res
+ */
+static void
+transfer_finish (transferptr t, CURLcode res)
+{
+  double time = 0;
+  if (t->curl != NULL)
+    {
+      curl_easy_getinfo (t->curl, CURLINFO_RESPONSE_CODE, &t->status);
+      curl_easy_getinfo (t->curl, CURLINFO_TOTAL_TIME, &time);
+    }
+  handle_put (t->curl);
+  t->curl = NULL;
+  if (t->headers != NULL)
+    curl_slist_free_all (t->headers);
+  t->headers = NULL;
+  mapfile_close (t->old);
+  t->old = NULL;
+  /* finish parsing */
+  if (t->ctxt != NULL)
+    {
+      if (res == CURLE_OK)
+	htmlParseChunk (t->ctxt, NULL, 0, 1);
+      t->doc = t->ctxt->myDoc;
+      t->ctxt->myDoc = NULL;
+      htmlFreeParserCtxt (t->ctxt);
+      t->ctxt = NULL;
+      /* stamp nodes to speed up xpath evaluation */
+      if (t->doc != NULL)
+	xmlXPathOrderDocElems (t->doc);
+    }
+  /* feed circuit breaker of host */
+  host_report (t->host, (res == CURLE_OK && t->status < 500) ? 1 : 0);
+  if (res == CURLE_OK && spool_close (t, 1) != RET_OK)
+    res = CURLE_WRITE_ERROR;
+  if (res != CURLE_OK)
+    {
+      outputf (LVL_WARN, "[fetch] Could not fetch %s: %s\n", t->url,
+	       curl_easy_strerror (res));
+      buffer_free (t);
+      spool_close (t, 0);
+      tree_free (t);
+      t->state = FS_FAILED;
+      return;
+    }
+  /* fingerprint covers only what is left of a document cut off by the
+     parser, which happens after the closing tag's chunk was received */
+  if (t->status != 304)
+    {
+      if (t->cut != 0 && t->cut < t->received)
+	fingerprint_content (t);
+      else
+	finish_sha1 (t);
+    }
+  outputf (LVL_DEBUG, "[fetch] Fetched %s (status %ld)\n", t->url,
+	   t->status);
+  t->state = FS_DONE;
+  /* unlike mapfile_read_html(), the parser takes valid UTF-8 for what it
+     claims to be (or guesses), parse it again from memory if that
+     differs */
+  if (t->doc != NULL
+      && transfer_get_encoding (t) == XML_CHAR_ENCODING_UTF8
+      && (t->doc->encoding == NULL
+	  || xmlParseCharEncoding ((const char *) t->doc->encoding) !=
+	  XML_CHAR_ENCODING_UTF8 || has_bom (t)))
+    tree_free (t);
+  if (archive_get_mode () == ARCHIVE_RECORD)
+    {
+      const char *data;
+      size_t size;
+      data = transfer_get_content (t, &size);
+      archive_store (t->url, t->status, t->etag, t->lastmod, time, data,
+		     size);
+    }
+}
+
+/*
+ * start serving transfer @t from archive instead of network; it is due
+ * (t->notbefore) once it would have come over the simulated link, or
+ * after as long as it took when recorded
+ */
+static int
+replay_start (transferptr t)
+{
+  responseptr r;
+  const char *data;
+  size_t size, pos, len;
+  double delay;
+  if ((r = archive_load (t->url)) == NULL)
+    {
+      outputf (LVL_WARN, "[fetch] Could not fetch %s: not in archive\n",
+	       t->url);
+      t->state = FS_FAILED;
+      return RET_ERROR;
+    }
+  transfer_prepare (t);
+  t->status = response_get_status (r);
+  if (response_get_etag (r) != NULL)
+    t->etag = strdup (response_get_etag (r));
+  if (response_get_last_modified (r) != NULL)
+    t->lastmod = strdup (response_get_last_modified (r));
+  /* answer conditional requests like the server would have done */
+  if ((t->condetag != NULL && t->etag != NULL
+       && strcmp (t->condetag, t->etag) == 0)
+      || (t->condlastmod != NULL && t->lastmod != NULL
+	  && strcmp (t->condlastmod, t->lastmod) == 0))
+    t->status = 304;
+  else if ((data = response_get_data (r, &size)) != NULL)
+    {
+      /* pass document to writer as curl would, until it is cut off */
+      for (pos = 0; pos < size; pos += len)
+	{
+	  len = (size - pos < FETCH_REPLAY_CHUNK ? size - pos :
+		 FETCH_REPLAY_CHUNK);
+	  if (curl2libxml_writer ((void *) (data + pos), 1, len, t) != len)
+	    break;
+	}
+    }
+  if (latency < 0 && bandwidth == 0)
+    delay = response_get_time (r) * 1000;
+  else
+    delay = (latency > 0 ? latency : 0)
+      + (bandwidth > 0 ? t->received * 1000.0 / bandwidth : 0);
+  t->notbefore = now_ms () + delay;
+  t->state = FS_RUNNING;
+  outputf (LVL_DEBUG, "[fetch] Replaying %s in %.0lf ms (recorded in "
+	   "%.0lf ms)\n", t->url, delay, response_get_time (r) * 1000);
+  response_free (r);
+  return RET_OK;
+}
+
+/*
+ * complete replayed transfers, which are due; returns their number, @wait
+ * is set to the time (in ms) until the next one is due, -1 if none
+ */
+static int
+finish_replays (long *wait)
+{
+  int i, done = 0, n = xmlListSize (replays);
+  double now = now_ms ();
+  *wait = -1;
+  for (i = 0; i < n; i++)
+    {
+      transferptr t = (transferptr) xmlLinkGetData (xmlListFront (replays));
+      xmlListPopFront (replays);
+      if (t->notbefore <= now)
+	{
+	  host_finish (t->host);
+	  transfer_finish (t, CURLE_OK);
+	  done++;
+	}
+      else
+	{
+	  long ms = (long) (t->notbefore - now) + 1;
+	  if (*wait < 0 || ms < *wait)
+	    *wait = ms;
+	  xmlListPushBack (replays, t);
+	}
+    }
+  return done;
+}
+
+/*
+ * start queued transfers until @active of them are running concurrently,
+ * taking turns between hosts and respecting their limits; @wait is set to
+ * the time (in ms) until a rate-limited host may start again, -1 if none
+ */
+static int
+start_pending (int active, long *wait)
+{
+  hostptr h;
+  *wait = -1;
+  while (active < concurrency && (h = host_next_ready (wait)) != NULL)
+    {
+      int skip = (host_is_available (h) == 0);
+      transferptr t = (transferptr) host_start (h);
+      queued--;
+      if (skip != 0)
+	{
+	  /* breaker of host opened since @t was queued */
+	  host_finish (h);
+	  outputf (LVL_WARN, "[fetch] Skipping %s, %s failed too often\n",
+		   t->url, host_get_name (h));
+	  t->state = FS_FAILED;
+	  continue;
+	}
+      if (archive_get_mode () == ARCHIVE_REPLAY)
+	{
+	  /* replayed transfers take their slot until due */
+	  if (replay_start (t) != RET_OK)
+	    {
+	      host_finish (h);
+	      continue;
+	    }
+	  xmlListPushBack (replays, t);
+	  active++;
+	  continue;
+	}
+      if (transfer_start (t) != RET_OK
+	  || curl_multi_add_handle (multi, t->curl) != CURLM_OK)
+	{
+	  host_finish (h);
+	  transfer_finish (t, CURLE_FAILED_INIT);
+	  continue;
+	}
+      outputf (LVL_DEBUG, "[fetch] Started fetching %s\n", t->url);
+      active++;
+    }
+  return active;
+}
+
+/*
+ * queue delayed transfers again, whose retry is due; returns time (in ms)
+ * until the next one is due, -1 if none
+ */
+static long
+requeue_delayed (void)
+{
+  int i, n = xmlListSize (delayed);
+  long wait = -1;
+  double now = now_ms ();
+  for (i = 0; i < n; i++)
+    {
+      transferptr t = (transferptr) xmlLinkGetData (xmlListFront (delayed));
+      xmlListPopFront (delayed);
+      if (t->notbefore <= now)
+	{
+	  host_enqueue (t->host, t);
+	  queued++;
+	}
+      else
+	{
+	  long ms = (long) (t->notbefore - now) + 1;
+	  if (wait < 0 || ms < wait)
+	    wait = ms;
+	  xmlListPushBack (delayed, t);
+	}
+    }
+  return wait;
+}
+#endif /* HAVE_LIBCURL */
+
+static void
+transfer_free (transferptr t)
+{
+  if (t == NULL)
+    return;
+#ifdef HAVE_LIBCURL
+  handle_put (t->curl);
+  if (t->headers != NULL)
+    curl_slist_free_all (t->headers);
+  buffer_free (t);
+  spool_close (t, 0);
+  mapfile_close (t->old);
+#endif
+  tree_free (t);
+  if (t->buf != NULL)
+    xmlFreeParserInputBuffer (t->buf);
+  mapfile_close (t->map);
+  if (t->url != NULL)
+    free (t->url);
+  if (t->condetag != NULL)
+    free (t->condetag);
+  if (t->condlastmod != NULL)
+    free (t->condlastmod);
+  if (t->condsha1 != NULL)
+    free (t->condsha1);
+  if (t->cache != NULL)
+    free (t->cache);
+  if (t->until != NULL)
+    free (t->until);
+  if (t->etag != NULL)
+    free (t->etag);
+  if (t->lastmod != NULL)
+    free (t->lastmod);
+  if (t->key != NULL)
+    free (t->key);
+  xmlFree (t);
+}
+
+static transferptr
+transfer_new (const char *url, const char *etag, const char *lastmod,
+	      const char *sha1, const char *cache, long maxbytes,
+	      const char *until, int options)
+{
+  transferptr t;
+  t = (transferptr) xmlMalloc (sizeof (transfer));
+  if (t == NULL)
+    {
+      outputf (LVL_ERR, "[fetch] Out of memory\n");
+      return NULL;
+    }
+  memset (t, 0, sizeof (transfer));
+  t->url = strdup (url);
+  if (etag != NULL)
+    t->condetag = strdup (etag);
+  if (lastmod != NULL)
+    t->condlastmod = strdup (lastmod);
+  if (sha1 != NULL)
+    t->condsha1 = strdup (sha1);
+  if (cache != NULL)
+    t->cache = strdup (cache);
+  t->maxbytes = maxbytes;
+  if (until != NULL)
+    t->until = strdup (until);
+  t->options = options;
+  t->enc = XML_CHAR_ENCODING_ERROR;
+#ifdef HAVE_LIBCURL
+  if ((t->host = host_get (url)) == NULL)
+    {
+      transfer_free (t);
+      return NULL;
+    }
+#endif
+  return t;
+}
+
+int
+fetch_init (void)
+{
+  if (transfers == NULL)
+    transfers = xmlHashCreate (0);
+#ifdef HAVE_LIBCURL
+  if (multi != NULL)
+    return RET_OK;
+  if (curl_global_init (CURL_GLOBAL_ALL) != CURLE_OK
+      || (multi = curl_multi_init ()) == NULL)
+    {
+      outputf (LVL_ERR, "[fetch] Unable to initialize curl\n");
+      return RET_ERROR;
+    }
+  /* share dns cache, tls sessions and connections between all handles */
+  if ((share = curl_share_init ()) != NULL)
+    {
+      curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+      curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  /* run concurrent transfers to one origin as streams of one connection */
+  curl_multi_setopt (multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+  handles = xmlListCreate (NULL, NULL);
+  delayed = xmlListCreate (NULL, NULL);
+  replays = xmlListCreate (NULL, NULL);
+  /* jitter of retries */
+  srand ((unsigned int) time (NULL) ^ (unsigned int) getpid ());
+#endif
+  return RET_OK;
+}
+
+void
+fetch_cleanup (void)
+{
+  if (transfers != NULL)
+    xmlHashFree (transfers, (xmlHashDeallocator) transfer_free);
+  transfers = NULL;
+#ifdef HAVE_LIBCURL
+  if (multi == NULL)
+    return;
+  xmlListDelete (delayed);
+  delayed = NULL;
+  xmlListDelete (replays);
+  replays = NULL;
+  xmlListWalk (handles, handle_cleanup_walker, NULL);
+  xmlListDelete (handles);
+  handles = NULL;
+  curl_multi_cleanup (multi);
+  multi = NULL;
+  if (share != NULL)
+    curl_share_cleanup (share);
+  share = NULL;
+  curl_global_cleanup ();
+  queued = 0;
+#endif
+  host_cleanup ();
+  archive_close ();
+}
+
+int
+fetch_set_concurrency (int max)
+{
+  if (max < 1)
+    {
+      outputf (LVL_WARN, "[fetch] Invalid number of transfers %d\n", max);
+      return RET_ERROR;
+    }
+  concurrency = max;
+  outputf (LVL_DEBUG, "[fetch] Setting concurrency %d\n", concurrency);
+  return RET_OK;
+}
+
+int
+fetch_set_mode (int m)
+{
+  mode = m;
+  outputf (LVL_DEBUG, "[fetch] Setting mode %d\n", mode);
+  return RET_OK;
+}
+
+int
+fetch_set_timeout (int total)
+{
+  /* 0 means no timeout */
+  if (total < 0)
+    {
+      outputf (LVL_WARN, "[fetch] Invalid timeout %d\n", total);
+      return RET_ERROR;
+    }
+  total_timeout = total;
+  outputf (LVL_DEBUG, "[fetch] Setting timeout %d\n", total_timeout);
+  return RET_OK;
+}
+
+int
+fetch_set_connect_timeout (int connect)
+{
+  /* 0 means curl's default */
+  if (connect < 0)
+    {
+      outputf (LVL_WARN, "[fetch] Invalid connect timeout %d\n", connect);
+      return RET_ERROR;
+    }
+  connect_timeout = connect;
+  outputf (LVL_DEBUG, "[fetch] Setting connect timeout %d\n",
+	   connect_timeout);
+  return RET_OK;
+}
+
+/*
+ * keep at most @mb megabytes of fetched documents in memory (0 = no
+ * limit), spool all others to temporary files
+ */
+int
+fetch_set_budget (long mb)
+{
+  if (mb < 0)
+    {
+      outputf (LVL_WARN, "[fetch] Invalid memory budget %ld\n", mb);
+      return RET_ERROR;
+    }
+  budget = (size_t) mb << 20;
+  outputf (LVL_DEBUG, "[fetch] Setting memory budget %ld MB\n", mb);
+  return RET_OK;
+}
+
+/*
+ * record all fetched documents into archive @dir, or replay them from
+ * there (@replay != 0)
+ */
+int
+fetch_set_archive (const char *dir, int replay)
+{
+#ifdef HAVE_LIBCURL
+  return archive_open (dir, (replay != 0 ? ARCHIVE_REPLAY : ARCHIVE_RECORD));
+#else
+  outputf (LVL_WARN, "[fetch] Recording and replaying need libcurl\n");
+  return RET_ERROR;
+#endif
+}
+
+/*
+ * simulate link of @lat ms latency and @bw bytes/s (0 = unlimited) when
+ * replaying documents; without either, replays take as long as recorded
+ * (@lat = -1)
+ */
+int
+fetch_set_link (long lat, long bw)
+{
+  if (lat < -1 || bw < 0)
+    {
+      outputf (LVL_WARN, "[fetch] Invalid link %ld ms, %ld bytes/s\n", lat,
+	       bw);
+      return RET_ERROR;
+    }
+  latency = lat;
+  bandwidth = bw;
+  outputf (LVL_DEBUG, "[fetch] Setting link %ld ms, %ld bytes/s\n", latency,
+	   bandwidth);
+  return RET_OK;
+}
+
+int
+fetch_queue (const char *url, const char *etag, const char *lastmod,
+	     const char *sha1, const char *cache, long maxbytes,
+	     const char *until, int options)
+{
+#ifdef HAVE_LIBCURL
+  transferptr t;
+  char *path, *key;
+  if (fetch_init () != RET_OK)
+    return RET_ERROR;
+  /* local documents are read on demand */
+  if ((path = local_path (url)) != NULL)
+    {
+      xmlFree (path);
+      return RET_OK;
+    }
+  /* documents are fetched only once per run, and kept for all users
+     announced here */
+  key = memo_key (url, etag, lastmod, maxbytes, until);
+  if ((t = (transferptr) xmlHashLookup (transfers, BAD_CAST key)) != NULL)
+    {
+      t->users++;
+      free (key);
+      return RET_OK;
+    }
+  if ((t = transfer_new (url, etag, lastmod, sha1, cache, maxbytes, until,
+			options)) == NULL)
+    {
+      free (key);
+      return RET_ERROR;
+    }
+  t->key = key;
+  t->users = 1;
+  xmlHashAddEntry (transfers, BAD_CAST key, t);
+  if (host_is_available (t->host) == 0)
+    {
+      outputf (LVL_WARN, "[fetch] Skipping %s, %s failed too often\n", url,
+	       host_get_name (t->host));
+      t->state = FS_FAILED;
+      return RET_OK;
+    }
+  host_enqueue (t->host, t);
+  queued++;
+  outputf (LVL_DEBUG, "[fetch] Queued %s\n", url);
+#endif
+  return RET_OK;
+}
+
+int
+fetch_perform (void)
+{
+#ifdef HAVE_LIBCURL
+  int active, running, done;
+  long wait, delay;
+  if (fetch_init () != RET_OK)
+    return RET_ERROR;
+  /* run all queued transfers, at most @concurrency at a time */
+  active = start_pending (0, &wait);
+  while (active > 0 || queued > 0 || xmlListEmpty (delayed) == 0)
+    {
+      CURLMsg *msg;
+      int msgs;
+      if (curl_multi_perform (multi, &running) != CURLM_OK)
+	{
+	  outputf (LVL_ERR, "[fetch] Fetching failed\n");
+	  return RET_ERROR;
+	}
+      /* collect completed transfers */
+      while ((msg = curl_multi_info_read (multi, &msgs)) != NULL)
+	{
+	  transferptr t = NULL;
+	  CURLcode res;
+	  if (msg->msg != CURLMSG_DONE)
+	    continue;
+	  curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE,
+			     (char **) &t);
+	  res = transfer_result (t, msg->data.result);
+	  curl_multi_remove_handle (multi, msg->easy_handle);
+	  host_finish (t->host);
+	  if (transfer_retry (t, res) == RET_OK)
+	    xmlListPushBack (delayed, t);
+	  else
+	    transfer_finish (t, res);
+	  active--;
+	}
+      /* refill free slots, then wait for network activity or until
+         a rate-limited host may continue, a retry or a replay is due */
+      delay = requeue_delayed ();
+      active = start_pending (active, &wait);
+      if (delay >= 0 && (wait < 0 || delay < wait))
+	wait = delay;
+      if ((done = finish_replays (&delay)) > 0)
+	{
+	  /* refill their slots at once */
+	  active -= done;
+	  continue;
+	}
+      if (delay >= 0 && (wait < 0 || delay < wait))
+	wait = delay;
+      if (wait < 0 || wait > 1000)
+	wait = 1000;
+      if (active == 0 && queued == 0 && xmlListEmpty (delayed) != 0)
+	break;
+      /* replays have no network activity to wait for */
+      if (archive_get_mode () == ARCHIVE_REPLAY)
+	pause_ms (wait);
+      else
+#if LIBCURL_VERSION_NUM >= 0x074200
+	curl_multi_poll (multi, NULL, 0, (int) wait, NULL);
+#else
+	curl_multi_wait (multi, NULL, 0, (int) wait, NULL);
+#endif
+    }
+#endif
+  return RET_OK;
+}
+
+/*
+ * fetch document of @t now, unless already done
+ */
+static void
+transfer_fetch (transferptr t)
+{
+  char *path;
+#ifndef HAVE_LIBCURL
+  int read;
+#endif
+  if (t->state != FS_QUEUED)
+    return;
+  /* map local documents instead of reading them */
+  if ((path = local_path (t->url)) != NULL)
+    {
+      if ((t->map = mapfile_open (path)) == NULL)
+	{
+	  outputf (LVL_WARN, "[fetch] Could not open %s\n", path);
+	  t->state = FS_FAILED;
+	}
+      else
+	{
+	  fingerprint_content (t);
+	  t->state = FS_DONE;
+	}
+      xmlFree (path);
+      return;
+    }
+#ifdef HAVE_LIBCURL
+  /* take transfer over from queue */
+  if (host_remove (t->host, t) != 0)
+    queued--;
+  xmlListRemoveFirst (delayed, t);
+  if (host_is_available (t->host) == 0)
+    {
+      outputf (LVL_WARN, "[fetch] Skipping %s, %s failed too often\n",
+	       t->url, host_get_name (t->host));
+      t->state = FS_FAILED;
+    }
+  /* replay synchronously */
+  if (t->state == FS_QUEUED && archive_get_mode () == ARCHIVE_REPLAY)
+    {
+      if (replay_start (t) == RET_OK)
+	{
+	  pause_ms (t->notbefore - now_ms ());
+	  transfer_finish (t, CURLE_OK);
+	}
+      return;
+    }
+  /* fetch synchronously */
+  while (t->state == FS_QUEUED)
+    {
+      CURLcode res = CURLE_FAILED_INIT;
+      if (transfer_start (t) == RET_OK)
+	res = transfer_result (t, curl_easy_perform (t->curl));
+      if (transfer_retry (t, res) == RET_OK)
+	pause_ms (t->notbefore - now_ms ());
+      else
+	transfer_finish (t, res);
+    }
+#else
+  t->state = FS_FAILED;
+  /* open document */
+  if ((t->buf =
+       xmlParserInputBufferCreateFilename (t->url,
+					   XML_CHAR_ENCODING_NONE)) == NULL)
+    {
+      outputf (LVL_WARN, "[fetch] Could not open %s\n", t->url);
+      return;
+    }
+  /* read document */
+  while ((read = xmlParserInputBufferRead (t->buf, 2048)) > 0);
+  if (read < 0)
+    {
+      outputf (LVL_WARN, "[fetch] Error reading %s\n", t->url);
+      return;
+    }
+  fingerprint_content (t);
+  t->state = FS_DONE;
+#endif
+}
+
+/*
+ * get document @url, fetched at most once per run for the users announced
+ * by fetch_queue(); its users share it until each of them called
+ * transfer_release()
+ */
+transferptr
+fetch_document (const char *url, const char *etag, const char *lastmod,
+		const char *sha1, const char *cache, long maxbytes,
+		const char *until, int options)
+{
+  transferptr t;
+  char *key;
+  if (fetch_init () != RET_OK)
+    return NULL;
+  key = memo_key (url, etag, lastmod, maxbytes, until);
+  if ((t = (transferptr) xmlHashLookup (transfers, BAD_CAST key)) == NULL)
+    {
+      if ((t = transfer_new (url, etag, lastmod, sha1, cache, maxbytes,
+				until, options)) == NULL)
+	{
+	  free (key);
+	  return NULL;
+	}
+      t->key = key;
+      xmlHashAddEntry (transfers, BAD_CAST key, t);
+    }
+  else
+    free (key);
+  if (t->users > 0)
+    t->users--;
+  transfer_fetch (t);
+  /* failed documents are not tried again during this run */
+  if (t->state == FS_FAILED)
+    return NULL;
+  t->refs++;
+  return t;
+}
+
+/*
+ * get fetched document of @t, NULL if not kept in memory
+ */
+const char *
+transfer_get_content (const transferptr t, size_t * size)
+{
+  const char *data = NULL;
+  *size = 0;
+  if (t->map != NULL)
+    {
+      *size = mapfile_get_size (t->map);
+      data = mapfile_get_data (t->map);
+    }
+  else if (t->buf != NULL)
+    {
+      *size = xmlBufferLength (t->buf->buffer);
+      data = (const char *) xmlBufferContent (t->buf->buffer);
+    }
+  /* document has been cut off */
+  if (t->cut != 0 && *size > t->cut)
+    *size = t->cut;
+  return data;
+}
+
+/*
+ * get document of @t parsed with HTML parser @options, parsing it unless
+ * parsed while fetching or by another user; it belongs to @t (NULL if
+ * parsed with other options, see transfer_suits())
+ */
+xmlDocPtr
+transfer_get_doc (transferptr t, int options)
+{
+  const char *data;
+  size_t size;
+  if (transfer_suits (t, options) == 0)
+    return NULL;
+  if (t->doc == NULL && t->status != 304
+      && (data = transfer_get_content (t, &size)) != NULL
+      && (t->doc = mapfile_read_html (data, size, t->url, options,
+				      transfer_get_encoding (t))) != NULL)
+    {
+      t->options = options;
+      t->tree = size * FETCH_TREE_WEIGHT;
+      inmemory += t->tree;
+    }
+  return t->doc;
+}
+
+/*
+ * get encoding of fetched document of @t as told by
+ * mapfile_get_encoding(), XML_CHAR_ENCODING_ERROR if not kept in memory
+ */
+xmlCharEncoding
+transfer_get_encoding (transferptr t)
+{
+  const char *data;
+  size_t size;
+  if (t->enc == XML_CHAR_ENCODING_ERROR && t->status != 304
+      && (data = transfer_get_content (t, &size)) != NULL)
+    {
+      t->enc = mapfile_get_encoding (data, size);
+      outputf (LVL_DEBUG, "[fetch] Taking %s as %s\n", t->url,
+	       mapfile_get_encoding_name (t->enc));
+    }
+  return t->enc;
+}
+
+/*
+ * tell whether @t has been parsed already, while fetching or by a user
+ */
+int
+transfer_is_parsed (const transferptr t)
+{
+  return (t->doc != NULL);
+}
+
+/*
+ * tell whether tree of @t (as parsed already or still to be parsed) suits
+ * a user with HTML parser @options, users with other options parse their
+ * own
+ */
+int
+transfer_suits (const transferptr t, int options)
+{
+  return (t->doc == NULL || t->options == options);
+}
+
+long
+transfer_get_status (const transferptr t)
+{
+  return t->status;
+}
+
+const char *
+transfer_get_etag (const transferptr t)
+{
+  return t->etag;
+}
+
+const char *
+transfer_get_last_modified (const transferptr t)
+{
+  return t->lastmod;
+}
+
+/*
+ * get fingerprint (hex sha1) of fetched document, NULL if not fetched
+ */
+const char *
+transfer_get_sha1 (const transferptr t)
+{
+  return (t->sha1[0] != '\0' ? t->sha1 : NULL);
+}
+
+/*
+ * release document of @t, the parsed version is freed after its last user;
+ * the document is kept only for users announced yet to come, others fetch
+ * it again
+ */
+void
+transfer_release (transferptr t)
+{
+  if (t == NULL || --t->refs > 0)
+    return;
+  tree_free (t);
+  if (t->users > 0)
+    return;
+  outputf (LVL_DEBUG, "[fetch] Dropping %s\n", t->url);
+  xmlHashRemoveEntry (transfers, BAD_CAST t->key, NULL);
+  transfer_free (t);
+}
@@ -0,0 +1,75 @@
+/* $Id$ */
+/* Fetch documents, concurrently if possible
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifndef __WC_FETCH_H__
+#define __WC_FETCH_H__
+
+#include <libxml/xmlIO.h>
+#include <libxml/tree.h>
+#include <libxml/encoding.h>
+
+#define FETCH_DEFAULT_CONCURRENCY 8
+#define FETCH_DEFAULT_CONNECT_TIMEOUT 30	/* seconds */
+#define FETCH_DEFAULT_TIMEOUT 120	/* seconds per document */
+#define FETCH_LOW_SPEED_TIME 30	/* abort if stalled for that long */
+#define FETCH_RETRIES 2		/* retries of transient failures */
+#define FETCH_BACKOFF 1000	/* ms until first retry, doubled for each */
+#define FETCH_REPLAY_CHUNK 16384	/* bytes passed to writer at once */
+#define FETCH_DEFAULT_BUDGET 64	/* megabytes of documents and trees */
+#define FETCH_TREE_WEIGHT 10	/* bytes of tree per byte of document */
+
+/* fetch modes */
+#define FETCH_PARSE 1		/* parse documents while fetching */
+
+typedef struct _transfer transfer;
+typedef transfer *transferptr;
+
+/* fetch functions */
+int fetch_init (void);
+void fetch_cleanup (void);
+int fetch_set_concurrency (int max);
+int fetch_set_mode (int m);
+int fetch_set_timeout (int total);
+int fetch_set_connect_timeout (int connect);
+int fetch_set_budget (long mb);
+int fetch_set_archive (const char *dir, int replay);
+int fetch_set_link (long lat, long bw);
+int fetch_queue (const char *url, const char *etag, const char *lastmod,
+		 const char *sha1, const char *cache, long maxbytes,
+		 const char *until, int options);
+int fetch_perform (void);
+transferptr fetch_document (const char *url, const char *etag,
+			    const char *lastmod, const char *sha1,
+			    const char *cache, long maxbytes,
+			    const char *until, int options);
+
+/* transfer functions */
+const char *transfer_get_content (const transferptr t, size_t * size);
+xmlDocPtr transfer_get_doc (transferptr t, int options);
+int transfer_is_parsed (const transferptr t);
+int transfer_suits (const transferptr t, int options);
+xmlCharEncoding transfer_get_encoding (transferptr t);
+long transfer_get_status (const transferptr t);
+const char *transfer_get_etag (const transferptr t);
+const char *transfer_get_last_modified (const transferptr t);
+const char *transfer_get_sha1 (const transferptr t);
+void transfer_release (transferptr t);
+
+#endif /* __WC_FETCH_H__ */
@@ -27,12 +27,16 @@
 #include <wx/splitter.h>
 #include <wx/cmdline.h>
 #include <wx/grid.h>
+#include <libxml/parser.h>
 #include <libxml/xpath.h>
 #include <libxml/list.h>
 #include "monfile.h"
 #include "metafile.h"
 #include "monitor.h"
 #include "basedir.h"
+#include "fetch.h"
+#include "mapfile.h"
+#include "arena.h"
 #include "global.h"
 #include "gmain.h"
 #if !defined(__WXMSW__)
@@ -452,7 +456,6 @@ WcFrame::doCheck (monfileptr mf, int update)
   metafileptr mef;
   const xmlChar *mfname;
   int ret, count = 0;
-  vpairptr lastvp = NULL;
   wxTreeItemId mf_node;
   /* read monitor file @mf */
   mfname = monfile_get_name (mf);
@@ -467,6 +470,8 @@ WcFrame::doCheck (monfileptr mf, int update)
       const xmlChar *name;
       if (ret == RET_EOF)
 	break;
+      if (ret != RET_OK)
+	continue;
       /* we obtained a monitor @m */
       name = monitor_get_name (m);
       nextchk = monitor_get_next_check (mef, m);
@@ -492,7 +497,7 @@ WcFrame::doCheck (monfileptr mf, int update)
 		  if (update != 0)
 		    {
 		      vpairptr vp = monitor_get_vpair (m);
-		      if (lastvp != vp)
+		      if (vpair_is_downloaded (vp) == 0)
 			{
 			  /* update of @vp necessary */
 			  outputf (LVL_NOTICE, "Updating %s\n",
@@ -500,11 +505,11 @@ WcFrame::doCheck (monfileptr mf, int update)
 			  indent (LVL_NOTICE);
 			  vpair_download (vp);
 			  outdent (LVL_NOTICE);
-			  lastvp = vp;
 			}
 		      else
 			outputf (LVL_DEBUG,
 				 "Skipping update, already done\n");
+		      monitor_keep_result (m);
 		    }
 		  count++;
 		}
@@ -721,6 +726,11 @@ WcApp::OnInit ()
   /* Prepare main window. */
   WcFrame *frame = new WcFrame (_ ("gwebchanges"));
 
+  /* Let libxml2 allocate per document from arenas, before anything else;
+     its globals are set up outside of any arena. */
+  arena_init ();
+  xmlInitParser ();
+
   /* Register error function. */
   xmlSetGenericErrorFunc (NULL, xml_errfunc);
 
@@ -763,6 +773,13 @@ WcApp::OnInit ()
       return errexit (_ ("No monitor files found, exiting."));
     }
 
+  /* Prepare fetching of documents. */
+  if (fetch_init () != RET_OK)
+    {
+      basedir_close (basedir);
+      return errexit (_ ("Could not initialize fetching, exiting."));
+    }
+
   /* Walk through all monitor files found. */
   while (xmlListEmpty (filelist) == 0)
     {
@@ -810,6 +827,9 @@ WcApp::OnInit ()
   basedir = NULL;
   xmlListDelete (filelist);
   filelist = NULL;
+  fetch_cleanup ();
+  monitor_cleanup ();
+  mapfile_cleanup ();
   xmlCleanupParser ();
 
   /* Exit if nothing has happened. */
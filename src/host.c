@@ -0,0 +1,338 @@
+/* $Id$ */
+/* Per-host scheduling of document transfers
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#include <libxml/xmlmemory.h>
+#include <libxml/hash.h>
+#include <libxml/list.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "host.h"
+#include "global.h"
+
+struct _host
+{
+  /* user-filled variables */
+  char *name;
+  int maxconn;			/* concurrent transfers, 0 = default */
+  double rate;			/* transfers per second, 0 = unlimited */
+  /* state variables */
+  int active;
+  double tokens;
+  double stamp;			/* time of last token refill */
+  xmlListPtr queue;
+  int failures;			/* failed documents in a row */
+  time_t until;			/* skip host until then */
+  int reported;			/* state is known from this run */
+  int trial;			/* one more try after cooling down */
+};
+
+typedef struct
+{
+  double now;
+  long wait;
+  hostptr found;
+} readyscan;
+
+static xmlHashTablePtr hosts = NULL;	/* all hosts by name */
+static xmlListPtr order = NULL;	/* hosts in round-robin order */
+
+static double
+now (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * extract lowercase host (and port) from @url
+ */
+static char *
+url_to_host (const char *url)
+{
+  const char *start, *end, *pos;
+  char *name;
+  size_t i, len;
+  start = strstr (url, "://");
+  start = (start == NULL ? url : start + 3);
+  end = start + strcspn (start, "/?#");
+  /* skip user info */
+  for (pos = start; pos < end; pos++)
+    if (*pos == '@')
+      start = pos + 1;
+  len = end - start;
+  name = (char *) malloc (len + 1);
+  for (i = 0; i < len; i++)
+    name[i] = tolower ((unsigned char) start[i]);
+  name[len] = '\0';
+  return name;
+}
+
+static void
+host_free (hostptr h)
+{
+  if (h == NULL)
+    return;
+  if (h->name != NULL)
+    free (h->name);
+  if (h->queue != NULL)
+    xmlListDelete (h->queue);
+  xmlFree (h);
+}
+
+/*
+ * add tokens to bucket of @h for time passed since last refill
+ */
+static void
+refill (hostptr h, double t)
+{
+  double burst = (h->rate < 1 ? 1 : h->rate);
+  h->tokens += (t - h->stamp) * h->rate;
+  if (h->tokens > burst)
+    h->tokens = burst;
+  h->stamp = t;
+}
+
+static int
+ready_walker (const void *data, void *user)
+{
+  hostptr h = (hostptr) data;
+  readyscan *rs = (readyscan *) user;
+  int maxconn = (h->maxconn > 0 ? h->maxconn : HOST_DEFAULT_CONNECTIONS);
+  if (xmlListEmpty (h->queue) != 0)
+    return 1;
+  /* transfers of a skipped host are failed at once by the caller, the
+     others wait for the outcome of its try after cooling down */
+  if (h->failures >= HOST_BREAKER_FAILURES && time (NULL) < h->until)
+    {
+      rs->found = h;
+      return 0;
+    }
+  if ((h->trial != 0 && h->active > 0) || h->active >= maxconn)
+    return 1;
+  if (h->rate > 0)
+    {
+      refill (h, rs->now);
+      if (h->tokens < 1)
+	{
+	  /* time until next token */
+	  long ms = (long) ((1 - h->tokens) * 1000 / h->rate) + 1;
+	  if (rs->wait < 0 || ms < rs->wait)
+	    rs->wait = ms;
+	  return 1;
+	}
+    }
+  rs->found = h;
+  return 0;
+}
+
+hostptr
+host_get (const char *url)
+{
+  hostptr h;
+  char *name;
+  if (hosts == NULL)
+    {
+      hosts = xmlHashCreate (0);
+      order = xmlListCreate (NULL, NULL);
+    }
+  name = url_to_host (url);
+  h = (hostptr) xmlHashLookup (hosts, BAD_CAST name);
+  if (h != NULL)
+    {
+      free (name);
+      return h;
+    }
+  /* allocate host struct */
+  h = (hostptr) xmlMalloc (sizeof (host));
+  if (h == NULL)
+    {
+      outputf (LVL_ERR, "[host] Out of memory\n");
+      free (name);
+      return NULL;
+    }
+  /* fill host struct */
+  memset (h, 0, sizeof (host));
+  h->name = name;
+  h->tokens = 1;
+  h->stamp = now ();
+  h->queue = xmlListCreate (NULL, NULL);
+  xmlHashAddEntry (hosts, BAD_CAST h->name, h);
+  xmlListPushBack (order, h);
+  return h;
+}
+
+int
+host_set_limits (const char *url, int maxconn, double rate)
+{
+  hostptr h;
+  if ((h = host_get (url)) == NULL)
+    return RET_ERROR;
+  /* several limits for one host: the strictest one wins */
+  if (maxconn > 0 && (h->maxconn == 0 || maxconn < h->maxconn))
+    h->maxconn = maxconn;
+  if (rate > 0 && (h->rate == 0 || rate < h->rate))
+    h->rate = rate;
+  outputf (LVL_DEBUG, "[host] Limiting %s to %d connections, %.2lf/s\n",
+	   h->name, h->maxconn, h->rate);
+  return RET_OK;
+}
+
+void
+host_enqueue (hostptr h, void *data)
+{
+  xmlListPushBack (h->queue, data);
+}
+
+int
+host_remove (hostptr h, void *data)
+{
+  return xmlListRemoveFirst (h->queue, data);
+}
+
+hostptr
+host_next_ready (long *wait)
+{
+  readyscan rs;
+  *wait = -1;
+  if (order == NULL)
+    return NULL;
+  rs.now = now ();
+  rs.wait = -1;
+  rs.found = NULL;
+  xmlListWalk (order, ready_walker, &rs);
+  if (rs.found == NULL)
+    {
+      *wait = rs.wait;
+      return NULL;
+    }
+  /* round robin: let other hosts go first next time */
+  xmlListRemoveFirst (order, rs.found);
+  xmlListPushBack (order, rs.found);
+  return rs.found;
+}
+
+void *
+host_start (hostptr h)
+{
+  void *data;
+  if (xmlListEmpty (h->queue) != 0)
+    return NULL;
+  data = xmlLinkGetData (xmlListFront (h->queue));
+  xmlListPopFront (h->queue);
+  h->active++;
+  if (h->rate > 0)
+    h->tokens -= 1;
+  if (h->failures >= HOST_BREAKER_FAILURES && time (NULL) >= h->until)
+    {
+      outputf (LVL_INFO, "[host] Trying %s again\n", h->name);
+      h->trial = 1;
+    }
+  return data;
+}
+
+void
+host_finish (hostptr h)
+{
+  if (h->active > 0)
+    h->active--;
+}
+
+const char *
+host_get_name (const hostptr h)
+{
+  return h->name;
+}
+
+/*
+ * check circuit breaker of @h, after cooling down one more try is allowed
+ */
+int
+host_is_available (const hostptr h)
+{
+  if (h->failures < HOST_BREAKER_FAILURES)
+    return 1;
+  if (h->trial != 0 && h->active > 0)
+    return 0;
+  return (time (NULL) >= h->until ? 1 : 0);
+}
+
+/*
+ * record success (@ok != 0) or failure of a document fetched from @h
+ */
+void
+host_report (hostptr h, int ok)
+{
+  int shift;
+  h->reported = 1;
+  if (ok != 0)
+    {
+      if (h->failures >= HOST_BREAKER_FAILURES)
+	outputf (LVL_INFO, "[host] %s is back again\n", h->name);
+      h->failures = 0;
+      h->until = 0;
+      h->trial = 0;
+      return;
+    }
+  /* while open, only the try after cooling down counts, documents
+     started before the breaker opened do not */
+  if (h->failures >= HOST_BREAKER_FAILURES && h->trial == 0)
+    return;
+  h->trial = 0;
+  if (++h->failures < HOST_BREAKER_FAILURES)
+    return;
+  /* open circuit breaker, longer for each failed try */
+  shift = h->failures - HOST_BREAKER_FAILURES;
+  h->until = time (NULL) + ((time_t) HOST_BREAKER_COOLDOWN << (shift < 7 ?
+								 shift : 7));
+  outputf (LVL_WARN, "[host] %s failed %d times in a row, skipping it until %s",
+	   h->name, h->failures, ctime (&h->until));
+}
+
+void
+host_get_breaker (const hostptr h, int *failures, time_t * until)
+{
+  *failures = h->failures;
+  *until = h->until;
+}
+
+void
+host_set_breaker (hostptr h, int failures, time_t until)
+{
+  /* several metadata files may know @h, keep the worst state, unless
+     this run told better */
+  if (h->reported != 0 || failures < h->failures)
+    return;
+  h->failures = failures;
+  h->until = until;
+}
+
+void
+host_cleanup (void)
+{
+  if (hosts == NULL)
+    return;
+  xmlListDelete (order);
+  order = NULL;
+  xmlHashFree (hosts, (xmlHashDeallocator) host_free);
+  hosts = NULL;
+}
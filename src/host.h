@@ -0,0 +1,49 @@
+/* $Id$ */
+/* Per-host scheduling of document transfers
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifndef __WC_HOST_H__
+#define __WC_HOST_H__
+
+#include <time.h>
+
+#define HOST_DEFAULT_CONNECTIONS 4
+#define HOST_BREAKER_FAILURES 3	/* failures in a row until host is skipped */
+#define HOST_BREAKER_COOLDOWN 3600	/* seconds to skip host, doubled for
+					   each failed try after it */
+
+typedef struct _host host;
+typedef host *hostptr;
+
+/* host functions */
+hostptr host_get (const char *url);
+int host_set_limits (const char *url, int maxconn, double rate);
+void host_enqueue (hostptr h, void *data);
+int host_remove (hostptr h, void *data);
+hostptr host_next_ready (long *wait);
+void *host_start (hostptr h);
+void host_finish (hostptr h);
+const char *host_get_name (const hostptr h);
+int host_is_available (const hostptr h);
+void host_report (hostptr h, int ok);
+void host_get_breaker (const hostptr h, int *failures, time_t * until);
+void host_set_breaker (hostptr h, int failures, time_t until);
+void host_cleanup (void);
+
+#endif /* __WC_HOST_H__ */
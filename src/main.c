@@ -21,16 +21,21 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/xmlstring.h>
 #include <libxml/list.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "monfile.h"
 #include "metafile.h"
 #include "monitor.h"
 #include "basedir.h"
+#include "fetch.h"
+#include "mapfile.h"
+#include "arena.h"
 #include "global.h"
 
 #ifdef HAVE_GETOPT_H
@@ -48,6 +53,15 @@ static int force = 0;		/* force checking */
 enum action
 { NONE, CHECK, INIT, UPDATE, REMOVE, TOOMANY };
 
+/* monitor file to process, with its metadata file (if checking) */
+typedef struct _job
+{
+  monfileptr mf;
+  metafileptr mef;
+  int ret;			/* of prefetching */
+} job;
+typedef job *jobptr;
+
 /*
  * callback output-function
  */
@@ -171,17 +185,58 @@ print_results (int l, xmlXPathObjectPtr oldres, xmlXPathObjectPtr curres)
 }
 
 /*
- * initialize: download all referenced documents
+ * prefetch: queue all documents of @mf, whose monitors are due for
+ * checking (@mef != NULL) or which are referenced at all (@mef == NULL)
  */
 static int
-do_init (monfileptr mf)
+do_prefetch (monfileptr mf, metafileptr mef)
 {
   int ret;
+  if (mef == NULL)
+    {
+      vpairptr vp;
+      while ((ret = monfile_get_next_vpair (mf, &vp)) != RET_EOF)
+	{
+	  if (ret == RET_ERROR)
+	    break;
+	  if (ret != RET_OK)
+	    continue;
+	  vpair_prefetch (vp);
+	  vpair_close (vp);
+	}
+    }
+  else
+    {
+      monitorptr m;
+      while ((ret = monfile_get_next_monitor (mf, &m)) != RET_EOF)
+	{
+	  if (ret == RET_ERROR)
+	    break;
+	  if (ret != RET_OK)
+	    continue;
+	  if (force != 0 || time (NULL) >= monitor_get_next_check (mef, m))
+	    vpair_prefetch (monitor_get_vpair (m));
+	  monitor_free (m);
+	}
+    }
+  if (ret == RET_ERROR)
+    return RET_ERROR;
+  /* restart reading @mf */
+  return monfile_rewind (mf);
+}
+
+/*
+ * initialize: download all referenced documents
+ */
+static int
+do_init (monfileptr mf, int ret)
+{
   vpairptr vp;
   /* read monitor file @mf */
   outputf (LVL_NOTICE, "Monitor File %s\n", monfile_get_name (mf));
   indent (LVL_NOTICE);
-  while ((ret = monfile_get_next_vpair (mf, &vp)) != RET_EOF)
+  while (ret != RET_ERROR
+	 && (ret = monfile_get_next_vpair (mf, &vp)) != RET_EOF)
     {
       if (ret == RET_ERROR)
 	break;
@@ -197,38 +252,39 @@ do_init (monfileptr mf)
 }
 
 /*
- * check: print, which monitors have changed and how (and @update cache)
+ * check: print, which monitors have changed and how (and @update cache),
+ * according to metadata file @mef (read when prefetching)
  */
 static int
-do_check (monfileptr mf, int update)
+do_check (monfileptr mf, metafileptr mef, int ret, int update)
 {
   monitorptr m;
-  metafileptr mef;
   const xmlChar *mfname;
-  int ret, count = 0;
-  vpairptr lastvp = NULL;
+  int count = 0;
   /* read monitor file @mf */
   mfname = monfile_get_name (mf);
   outputf (LVL_NOTICE, "Monitor File %s\n", mfname);
   indent (LVL_NOTICE);
-  /* read metadata file @mef */
-  mef = metafile_open (mf);
-  metafile_read (mef);
-  while ((ret = monfile_get_next_monitor (mf, &m)) != RET_ERROR)
+  while (ret != RET_ERROR
+	 && (ret = monfile_get_next_monitor (mf, &m)) != RET_ERROR)
     {
       time_t nextchk;
       const xmlChar *name;
       if (ret == RET_EOF)
 	break;
+      if (ret != RET_OK)
+	continue;
       /* we obtained a monitor @m */
       name = monitor_get_name (m);
+      /* remember failing hosts for the next run */
+      metafile_add_host (mef, vpair_get_url (monitor_get_vpair (m)));
       nextchk = monitor_get_next_check (mef, m);
       if (force != 0 || time (NULL) >= nextchk)
 	{
 	  /* checking of monitor @m is necessary */
 	  outputf (LVL_NOTICE, "Checking %s now:\n", name);
 	  indent (LVL_NOTICE);
-	  if ((ret = monitor_evaluate (m)) == RET_OK)
+	  if (monitor_evaluate (m) == RET_OK)
 	    {
 	      /* monitor @m was evaluable */
 	      if (monitor_triggered (m) != 0)
@@ -244,7 +300,7 @@ do_check (monfileptr mf, int update)
 		  if (update != 0)
 		    {
 		      vpairptr vp = monitor_get_vpair (m);
-		      if (lastvp != vp)
+		      if (vpair_is_downloaded (vp) == 0)
 			{
 			  /* update of @vp necessary */
 			  outputf (LVL_NOTICE, "Updating %s\n",
@@ -252,11 +308,11 @@ do_check (monfileptr mf, int update)
 			  indent (LVL_NOTICE);
 			  vpair_download (vp);
 			  outdent (LVL_NOTICE);
-			  lastvp = vp;
 			}
 		      else
 			outputf (LVL_DEBUG,
 				 "Skipping update, already done\n");
+		      monitor_keep_result (m);
 		    }
 		  count++;
 		}
@@ -321,6 +377,14 @@ usage (FILE * f)
   fprintf (f, "Options:\n");
   fprintf (f, "  -f  force checking/updating of all monitors now\n");
   fprintf (f, "  -b  set base directory\n");
+  fprintf (f, "  -j  set maximum number of concurrent downloads\n");
+  fprintf (f, "  -t  set timeout per download in seconds\n");
+  fprintf (f, "  -T  set timeout for connecting in seconds\n");
+  fprintf (f, "  -m  set megabytes of documents kept in memory\n");
+  fprintf (f, "  -W  record downloaded documents into archive directory\n");
+  fprintf (f, "  -R  replay documents from archive directory\n");
+  fprintf (f, "  -L  set latency of replayed documents in milliseconds\n");
+  fprintf (f, "  -B  set bandwidth of replayed documents in KB/s\n");
   fprintf (f, "  -q  quiet mode, suppress most stdout messages\n");
   fprintf (f, "  -v  verbose mode, repeat to increase stdout messages\n");
 }
@@ -352,16 +416,22 @@ main (int argc, char **argv)
 {
   int c, count = 0;
   int action = NONE;
+  long latency = -1, bandwidth = 0;
   basedirptr basedir = NULL;
   char *userdir = NULL;
-  xmlListPtr filelist = NULL;
+  xmlListPtr filelist = NULL, jobs = NULL;
+
+  /* let libxml2 allocate per document from arenas, before anything else;
+     its globals are set up outside of any arena */
+  arena_init ();
+  xmlInitParser ();
 
   /* register error function */
   xmlSetGenericErrorFunc (NULL, xml_errfunc);
 
   /* parse cmdline args */
   opterr = 0;			/* prevent getopt from printing errors */
-  while ((c = getopt (argc, argv, "icurhVfb:qv")) != -1)
+  while ((c = getopt (argc, argv, "icurhVfb:j:t:T:m:W:R:L:B:qv")) != -1)
     {
       switch (c)
 	{
@@ -394,6 +464,53 @@ main (int argc, char **argv)
 	      errexit ("More than one base directory specified, exiting.");
 	  userdir = strdup (optarg);
 	  break;
+	case 'j':		/* concurrent downloads */
+	  if (fetch_set_concurrency (atoi (optarg)) != RET_OK)
+	    {
+	      if (userdir != NULL)
+		free (userdir);
+	      return errexit ("Invalid number of downloads '%s'.", optarg);
+	    }
+	  break;
+	case 't':		/* timeout per download */
+	  if (fetch_set_timeout (atoi (optarg)) != RET_OK)
+	    {
+	      if (userdir != NULL)
+		free (userdir);
+	      return errexit ("Invalid timeout '%s'.", optarg);
+	    }
+	  break;
+	case 'T':		/* timeout for connecting */
+	  if (fetch_set_connect_timeout (atoi (optarg)) != RET_OK)
+	    {
+	      if (userdir != NULL)
+		free (userdir);
+	      return errexit ("Invalid connect timeout '%s'.", optarg);
+	    }
+	  break;
+	case 'm':		/* memory budget */
+	  if (fetch_set_budget (atol (optarg)) != RET_OK)
+	    {
+	      if (userdir != NULL)
+		free (userdir);
+	      return errexit ("Invalid memory budget '%s'.", optarg);
+	    }
+	  break;
+	case 'W':		/* record into archive */
+	case 'R':		/* replay from archive */
+	  if (fetch_set_archive (optarg, (c == 'R')) != RET_OK)
+	    {
+	      if (userdir != NULL)
+		free (userdir);
+	      return errexit ("Invalid archive '%s'.", optarg);
+	    }
+	  break;
+	case 'L':		/* latency of replays */
+	  latency = atol (optarg);
+	  break;
+	case 'B':		/* bandwidth of replays */
+	  bandwidth = atol (optarg) * 1024;
+	  break;
 	case 'v':		/* verbose */
 	  lvl_verbos++;
 	  break;
@@ -411,6 +528,14 @@ main (int argc, char **argv)
 	}
     }
 
+  /* Simulate link when replaying. */
+  if (fetch_set_link (latency, bandwidth) != RET_OK)
+    {
+      if (userdir != NULL)
+	free (userdir);
+      return errexit ("Invalid latency or bandwidth.");
+    }
+
   /* Do we have a unique command? */
   if (action == NONE)
     return errexit ("No command given, exiting.");
@@ -460,10 +585,23 @@ main (int argc, char **argv)
       return errexit ("No monitor files found, exiting.");
     }
 
-  /* Walk through all monitor files found. */
+  /* Prepare fetching of documents. */
+  if (fetch_init () != RET_OK)
+    {
+      basedir_close (basedir);
+      return errexit ("Could not initialize fetching, exiting.");
+    }
+  /* Parse documents while fetching when checking or updating. */
+  if (action == CHECK || action == UPDATE)
+    fetch_set_mode (FETCH_PARSE);
+
+  /* Open all monitor files found, queueing their documents at once: they
+     are fetched concurrently, documents of several monitor files only
+     once, and kept until their last user is done. */
+  jobs = xmlListCreate (NULL, NULL);
   while (xmlListEmpty (filelist) == 0)
     {
-      int ret = 0;
+      jobptr j;
       monfileptr mf;
       xmlLinkPtr lk;
       const char *filename;
@@ -481,32 +619,64 @@ main (int argc, char **argv)
 	  count = -1;
 	  continue;
 	}
+      j = (jobptr) malloc (sizeof (job));
+      j->mf = mf;
+      j->mef = NULL;
+      j->ret = RET_OK;
+      /* Read metadata file, telling which monitors are due. */
+      if (action == CHECK || action == UPDATE)
+	{
+	  j->mef = metafile_open (mf);
+	  metafile_read (j->mef);
+	}
+      if (action != REMOVE)
+	j->ret = do_prefetch (mf, j->mef);
+      xmlListPushBack (jobs, j);
+      xmlListPopFront (filelist);
+    }
+  fetch_perform ();
+
+  /* Walk through all monitor files opened. */
+  while (xmlListEmpty (jobs) == 0)
+    {
+      int ret = 0;
+      jobptr j;
+      /* Get next monitor file from job list */
+      j = (jobptr) xmlLinkGetData (xmlListFront (jobs));
+
       /* Process monitor file. */
-      outputf (LVL_INFO, "Processing monitor file %s\n", filename);
+      outputf (LVL_INFO, "Processing monitor file %s\n",
+	       monfile_get_filename (j->mf));
       switch (action)
 	{
 	case INIT:
-	  ret = do_init (mf);
+	  ret = do_init (j->mf, j->ret);
 	  break;
 	case CHECK:
-	  ret = do_check (mf, 0);
+	  ret = do_check (j->mf, j->mef, j->ret, 0);
 	  break;
 	case UPDATE:
-	  ret = do_check (mf, 1);
+	  ret = do_check (j->mf, j->mef, j->ret, 1);
 	  break;
 	case REMOVE:
-	  ret = do_remove (mf);
+	  ret = do_remove (j->mf);
 	  break;
 	}
       count = (ret < 0 || count < 0 ? -1 : count + ret);
       /* Ready to close monitor file. */
-      monfile_close (mf);
-      xmlListPopFront (filelist);
+      monfile_close (j->mf);
+      free (j);
+      xmlListPopFront (jobs);
     }
+  xmlListDelete (jobs);
+  jobs = NULL;
   basedir_close (basedir);
   basedir = NULL;
   xmlListDelete (filelist);
   filelist = NULL;
+  fetch_cleanup ();
+  monitor_cleanup ();
+  mapfile_cleanup ();
   xmlCleanupParser ();
   return count;
 }
@@ -0,0 +1,502 @@
+/* $Id$ */
+/* Map local files into memory and parse them from there
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <libxml/HTMLparser.h>
+#include <libxml/xpath.h>
+#include <libxml/SAX2.h>
+#include <libxml/dict.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define USE_MMAP
+#endif
+#include "mapfile.h"
+#include "global.h"
+
+#define MAPFILE_CHUNK 65536	/* bytes passed to parser at once */
+#define MAPFILE_ONES ((size_t) -1 / 0xff)	/* 0x01 in every byte */
+#define MAPFILE_HIGHS (MAPFILE_ONES * 0x80)	/* 0x80 in every byte */
+#define MAPFILE_ESCS (MAPFILE_ONES * 0x1b)	/* ESC in every byte */
+#define MAPFILE_PRESCAN 1024	/* bytes searched for a declared charset */
+
+/* named sets of parser options, selectable per document */
+static const struct
+{
+  const char *name;
+  int options;
+} profiles[] =
+{
+  {"default", 0},
+  /* skip reporting errors, they are thrown away anyway */
+  {"quiet", HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING | HTML_PARSE_NONET},
+  /* keep short text within its node, saving an allocation */
+  {"compact", HTML_PARSE_COMPACT | HTML_PARSE_NONET},
+  /* all of the above, and no blank text nodes */
+  {"lean", HTML_PARSE_COMPACT | HTML_PARSE_NOBLANKS | HTML_PARSE_NOERROR
+   | HTML_PARSE_NOWARNING | HTML_PARSE_NONET},
+  {NULL, 0}
+};
+
+/* names of encodings told apart by mapfile_get_encoding() */
+static const struct
+{
+  xmlCharEncoding enc;
+  const char *name;
+} encodings[] =
+{
+  {XML_CHAR_ENCODING_ASCII, "US-ASCII"},
+  {XML_CHAR_ENCODING_UTF8, "UTF-8"},
+  /* anything else, left to the parser */
+  {XML_CHAR_ENCODING_NONE, "other"},
+  {XML_CHAR_ENCODING_ERROR, NULL}
+};
+
+/* names of all parsed documents, so equal names share one pointer */
+static xmlDictPtr names = NULL;
+/* used instead for the time being, if set */
+static xmlDictPtr scoped = NULL;
+
+struct _mapfile
+{
+  /* state variables */
+  char *data;
+  size_t size;
+  int mapped;			/* mmap()ed or read into memory */
+};
+
+#ifdef USE_MMAP
+/*
+ * map file @filename into memory
+ */
+static int
+map_file (mapfileptr mp, const char *filename)
+{
+  int fd;
+  void *data;
+  if (mp->size == 0)
+    return RET_ERROR;
+  if ((fd = open (filename, O_RDONLY)) < 0)
+    return RET_ERROR;
+  data = mmap (NULL, mp->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return RET_ERROR;
+#ifdef MADV_SEQUENTIAL
+  madvise (data, mp->size, MADV_SEQUENTIAL);
+#endif
+  mp->data = (char *) data;
+  mp->mapped = 1;
+  return RET_OK;
+}
+#endif /* USE_MMAP */
+
+/*
+ * read file @filename into memory at once
+ */
+static int
+read_file (mapfileptr mp, const char *filename)
+{
+  FILE *f;
+  if ((f = fopen (filename, "rb")) == NULL)
+    return RET_ERROR;
+  mp->data = (char *) malloc (mp->size + 1);
+  if (mp->data == NULL || fread (mp->data, 1, mp->size, f) != mp->size)
+    {
+      fclose (f);
+      return RET_ERROR;
+    }
+  fclose (f);
+  return RET_OK;
+}
+
+mapfileptr
+mapfile_open (const char *filename)
+{
+  mapfileptr mp;
+  struct stat st;
+  if (filename == NULL || stat (filename, &st) != 0
+      || S_ISREG (st.st_mode) == 0)
+    return NULL;
+  /* allocate mapfile struct */
+  mp = (mapfileptr) xmlMalloc (sizeof (mapfile));
+  if (mp == NULL)
+    {
+      outputf (LVL_ERR, "[mapfile] Out of memory\n");
+      return NULL;
+    }
+  /* fill mapfile struct */
+  memset (mp, 0, sizeof (mapfile));
+  mp->size = st.st_size;
+#ifdef USE_MMAP
+  if (map_file (mp, filename) == RET_OK)
+    {
+      outputf (LVL_DEBUG, "[mapfile] Mapped %s (%lu bytes)\n", filename,
+	       (unsigned long) mp->size);
+      return mp;
+    }
+#endif
+  if (read_file (mp, filename) != RET_OK)
+    {
+      mapfile_close (mp);
+      return NULL;
+    }
+  outputf (LVL_DEBUG, "[mapfile] Read %s (%lu bytes)\n", filename,
+	   (unsigned long) mp->size);
+  return mp;
+}
+
+void
+mapfile_close (mapfileptr mp)
+{
+  if (mp == NULL)
+    return;
+#ifdef USE_MMAP
+  if (mp->mapped != 0)
+    munmap (mp->data, mp->size);
+  else
+#endif
+  if (mp->data != NULL)
+    free (mp->data);
+  xmlFree (mp);
+}
+
+const char *
+mapfile_get_data (const mapfileptr mp)
+{
+  return mp->data;
+}
+
+size_t
+mapfile_get_size (const mapfileptr mp)
+{
+  return mp->size;
+}
+
+/*
+ * get HTML parser options of profile @name, -1 if there is no such profile
+ */
+int
+mapfile_get_profile (const xmlChar * name)
+{
+  int i;
+  for (i = 0; profiles[i].name != NULL; i++)
+    if (xmlStrEqual (name, BAD_CAST profiles[i].name) == 1)
+      return profiles[i].options;
+  return -1;
+}
+
+/*
+ * tell whether the beginning of HTML document @data (@size bytes) declares
+ * a charset other than UTF-8, like browsers do in their prescan
+ */
+static int
+declares_other (const char *data, size_t size)
+{
+  const char *p, *end, *name;
+  size_t len;
+  end = data + (size < MAPFILE_PRESCAN ? size : MAPFILE_PRESCAN);
+  for (p = data; end - p > 7; p++)
+    {
+      if ((*p | 0x20) != 'c' || xmlStrncasecmp (BAD_CAST p, BAD_CAST "charset",
+						7) != 0)
+	continue;
+      for (p += 7; p < end && (*p == ' ' || *p == '\t'); p++);
+      if (p == end || *p != '=')
+	continue;
+      for (p++; p < end && (*p == ' ' || *p == '"' || *p == '\''); p++);
+      for (name = p; p < end && *p != '"' && *p != '\'' && *p != ';'
+	   && *p != '>' && *p != '/' && *p > ' '; p++);
+      len = p - name;
+      if (len == 0)
+	continue;
+      /* name cut off, it might be anything */
+      if (p == end)
+	return 1;
+      return ((len != 5 || xmlStrncasecmp (BAD_CAST name, BAD_CAST "utf-8",
+					   5) != 0)
+	      && (len != 4 || xmlStrncasecmp (BAD_CAST name, BAD_CAST "utf8",
+					      4) != 0));
+    }
+  return 0;
+}
+
+/*
+ * tell how to decode HTML document @data (@size bytes), checking a word at
+ * a time while it is ASCII: XML_CHAR_ENCODING_ASCII if it is pure ASCII,
+ * XML_CHAR_ENCODING_UTF8 if it is other valid UTF-8, declaring no other
+ * charset at its beginning, and XML_CHAR_ENCODING_NONE if the parser has
+ * to find out (NUL bytes hint at UTF-16 or worse, ESC bytes at ISO-2022)
+ */
+xmlCharEncoding
+mapfile_get_encoding (const char *data, size_t size)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  const unsigned char *end = p + size;
+  xmlCharEncoding enc = XML_CHAR_ENCODING_ASCII;
+  unsigned char c, lo, hi;
+  size_t w, i, n;
+  while (p < end)
+    {
+      /* skip words without high bits, NUL and ESC bytes */
+      while ((size_t) (end - p) >= sizeof (w))
+	{
+	  memcpy (&w, p, sizeof (w));
+	  if (((w | (w - MAPFILE_ONES)
+		| ((w ^ MAPFILE_ESCS) - MAPFILE_ONES)) & MAPFILE_HIGHS) != 0)
+	    break;
+	  p += sizeof (w);
+	}
+      if (p == end)
+	break;
+      c = *p++;
+      if (c >= 0x01 && c < 0x80 && c != 0x1b)
+	continue;
+      /* lead byte of a shortest form sequence up to U+10FFFF */
+      if (c < 0xc2 || c > 0xf4)
+	return XML_CHAR_ENCODING_NONE;
+      n = (c >= 0xf0 ? 3 : (c >= 0xe0 ? 2 : 1));
+      if ((size_t) (end - p) < n)
+	return XML_CHAR_ENCODING_NONE;
+      /* second byte rules out overlong forms and surrogates */
+      lo = (c == 0xe0 ? 0xa0 : (c == 0xf0 ? 0x90 : 0x80));
+      hi = (c == 0xed ? 0x9f : (c == 0xf4 ? 0x8f : 0xbf));
+      if (p[0] < lo || p[0] > hi)
+	return XML_CHAR_ENCODING_NONE;
+      for (i = 1; i < n; i++)
+	if ((p[i] & 0xc0) != 0x80)
+	  return XML_CHAR_ENCODING_NONE;
+      p += n;
+      enc = XML_CHAR_ENCODING_UTF8;
+    }
+  /* valid UTF-8 may still be meant as something else, which ASCII
+     decodes to the same in any case */
+  if (enc == XML_CHAR_ENCODING_UTF8 && declares_other (data, size) != 0)
+    return XML_CHAR_ENCODING_NONE;
+  return enc;
+}
+
+/*
+ * get name of encoding @enc as told by mapfile_get_encoding()
+ */
+const char *
+mapfile_get_encoding_name (xmlCharEncoding enc)
+{
+  int i;
+  for (i = 0; encodings[i].name != NULL; i++)
+    if (encodings[i].enc == enc)
+      return encodings[i].name;
+  return NULL;
+}
+
+/*
+ * get encoding named @name by mapfile_get_encoding_name(),
+ * XML_CHAR_ENCODING_ERROR if unknown
+ */
+xmlCharEncoding
+mapfile_find_encoding (const char *name)
+{
+  int i;
+  for (i = 0; encodings[i].name != NULL; i++)
+    if (strcmp (encodings[i].name, name) == 0)
+      return encodings[i].enc;
+  return XML_CHAR_ENCODING_ERROR;
+}
+
+/*
+ * parse HTML document @data (@size bytes) straight from where it is,
+ * chunk by chunk, with HTML parser @options; unlike htmlReadMemory(), this
+ * never duplicates all of @data (libxml's static input buffers are no
+ * option, they are not reliable with large inputs); @enc is what
+ * mapfile_get_encoding() tells about @data, XML_CHAR_ENCODING_ERROR to
+ * let it find out
+ */
+xmlDocPtr
+mapfile_read_html (const char *data, size_t size, const char *url,
+		   int options, xmlCharEncoding enc)
+{
+  return mapfile_read_html_sax (data, size, url, options, enc, NULL, NULL);
+}
+
+/*
+ * parse HTML document like mapfile_read_html(), but with SAX handlers
+ * @sax (default ones if NULL) and @priv as private data of the parser
+ */
+xmlDocPtr
+mapfile_read_html_sax (const char *data, size_t size, const char *url,
+		       int options, xmlCharEncoding enc,
+		       htmlSAXHandlerPtr sax, void *priv)
+{
+  htmlParserCtxtPtr ctxt;
+  xmlDocPtr doc;
+  size_t pos, len;
+  if (enc == XML_CHAR_ENCODING_ERROR)
+    enc = mapfile_get_encoding (data, size);
+  if (enc == XML_CHAR_ENCODING_ASCII || enc == XML_CHAR_ENCODING_UTF8)
+    {
+      /* take ASCII and valid UTF-8 (not declared otherwise) as such, and
+         spare the parser detecting and converting it */
+      if (size >= 3 && memcmp (data, "\xef\xbb\xbf", 3) == 0)
+	{
+	  data += 3;
+	  size -= 3;
+	}
+      options |= HTML_PARSE_IGNORE_ENC;
+      enc = XML_CHAR_ENCODING_UTF8;
+    }
+  else
+    enc = XML_CHAR_ENCODING_NONE;
+  /* first chunk also determines encoding (unless known already) */
+  len = (size < MAPFILE_CHUNK ? size : MAPFILE_CHUNK);
+  ctxt = htmlCreatePushParserCtxt (sax, NULL, data, (int) len, url, enc);
+  if (ctxt == NULL)
+    return NULL;
+  ctxt->_private = priv;
+  htmlCtxtUseOptions (ctxt, options);
+  mapfile_prepare (ctxt);
+  for (pos = len; pos < size; pos += len)
+    {
+      len = (size - pos < MAPFILE_CHUNK ? size - pos : MAPFILE_CHUNK);
+      htmlParseChunk (ctxt, data + pos, (int) len, 0);
+    }
+  htmlParseChunk (ctxt, NULL, 0, 1);
+  doc = ctxt->myDoc;
+  ctxt->myDoc = NULL;
+  htmlFreeParserCtxt (ctxt);
+  /* stamp nodes to speed up xpath evaluation */
+  if (doc != NULL)
+    xmlXPathOrderDocElems (doc);
+  return doc;
+}
+
+/*
+ * get dictionary shared by all parsed documents (or the one set instead)
+ */
+xmlDictPtr
+mapfile_get_dict (void)
+{
+  if (scoped != NULL)
+    return scoped;
+  if (names == NULL)
+    names = xmlDictCreate ();
+  return names;
+}
+
+/*
+ * let documents parsed from now on use dictionary @dict instead of the
+ * shared one (again, if NULL); returns the one set before
+ */
+xmlDictPtr
+mapfile_set_dict (xmlDictPtr dict)
+{
+  xmlDictPtr prev = scoped;
+  scoped = dict;
+  return prev;
+}
+
+/*
+ * use dictionary @dict for @name, which was allocated on its own
+ */
+static const xmlChar *
+intern_name (xmlDictPtr dict, const xmlChar * name)
+{
+  const xmlChar *s;
+  if (name == NULL || (s = xmlDictLookup (dict, name, -1)) == NULL)
+    return name;
+  if (s != name)
+    xmlFree ((xmlChar *) name);
+  return s;
+}
+
+static void
+start_document (void *ctx)
+{
+  htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr) ctx;
+  xmlSAX2StartDocument (ctx);
+  if (ctxt->myDoc != NULL && ctxt->myDoc->dict == NULL)
+    {
+      ctxt->myDoc->dict = ctxt->dict;
+      xmlDictReference (ctxt->dict);
+    }
+}
+
+/*
+ * SAX handler creating elements like xmlSAX2StartElement(), but with
+ * names taken from the document's dictionary
+ */
+void
+mapfile_start_element (void *ctx, const xmlChar * name,
+		       const xmlChar ** atts)
+{
+  htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr) ctx;
+  xmlNodePtr node;
+  xmlAttrPtr attr;
+  xmlSAX2StartElement (ctx, name, atts);
+  node = ctxt->node;
+  if (node == NULL || node->doc == NULL || node->doc->dict == NULL)
+    return;
+  node->name = intern_name (node->doc->dict, node->name);
+  for (attr = node->properties; attr != NULL; attr = attr->next)
+    attr->name = intern_name (node->doc->dict, attr->name);
+}
+
+/*
+ * let HTML parser @ctxt put names into the dictionary of mapfile_get_dict();
+ * call before parsing any data
+ */
+void
+mapfile_prepare (htmlParserCtxtPtr ctxt)
+{
+  xmlDictPtr dict = mapfile_get_dict ();
+  if (dict == NULL)
+    return;
+  if (ctxt->dict != dict)
+    {
+      if (ctxt->dict != NULL)
+	xmlDictFree (ctxt->dict);
+      ctxt->dict = dict;
+      xmlDictReference (dict);
+      ctxt->str_xml = xmlDictLookup (dict, BAD_CAST "xml", 3);
+      ctxt->str_xmlns = xmlDictLookup (dict, BAD_CAST "xmlns", 5);
+      ctxt->str_xml_ns = xmlDictLookup (dict, XML_XML_NAMESPACE, 36);
+    }
+  ctxt->sax->startDocument = start_document;
+  if (ctxt->sax->startElement == xmlSAX2StartElement)
+    ctxt->sax->startElement = mapfile_start_element;
+}
+
+/*
+ * release shared dictionary, documents still using it keep a reference
+ */
+void
+mapfile_cleanup (void)
+{
+  if (names != NULL)
+    xmlDictFree (names);
+  names = NULL;
+}
@@ -0,0 +1,60 @@
+/* $Id$ */
+/* Map local files into memory and parse them from there
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifndef __WC_MAPFILE_H__
+#define __WC_MAPFILE_H__
+
+#include <stddef.h>
+#include <libxml/tree.h>
+#include <libxml/HTMLparser.h>
+#include <libxml/encoding.h>
+#include <libxml/dict.h>
+
+typedef struct _mapfile mapfile;
+typedef mapfile *mapfileptr;
+
+/* mapfile functions */
+mapfileptr mapfile_open (const char *filename);
+void mapfile_close (mapfileptr mp);
+const char *mapfile_get_data (const mapfileptr mp);
+size_t mapfile_get_size (const mapfileptr mp);
+
+/* parse HTML from memory */
+int mapfile_get_profile (const xmlChar * name);
+xmlCharEncoding mapfile_get_encoding (const char *data, size_t size);
+const char *mapfile_get_encoding_name (xmlCharEncoding enc);
+xmlCharEncoding mapfile_find_encoding (const char *name);
+xmlDocPtr mapfile_read_html (const char *data, size_t size,
+			     const char *url, int options,
+			     xmlCharEncoding enc);
+xmlDocPtr mapfile_read_html_sax (const char *data, size_t size,
+				 const char *url, int options,
+				 xmlCharEncoding enc, htmlSAXHandlerPtr sax,
+				 void *priv);
+
+/* names shared by all parsed documents */
+xmlDictPtr mapfile_get_dict (void);
+xmlDictPtr mapfile_set_dict (xmlDictPtr dict);
+void mapfile_prepare (htmlParserCtxtPtr ctxt);
+void mapfile_start_element (void *ctx, const xmlChar * name,
+			    const xmlChar ** atts);
+void mapfile_cleanup (void);
+
+#endif /* __WC_MAPFILE_H__ */
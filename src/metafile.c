@@ -26,6 +26,7 @@
 #include "metafile.h"
 #include "monitor.h"
 #include "basedir.h"
+#include "host.h"
 #include "global.h"
 
 struct _metafile
@@ -35,6 +36,7 @@ struct _metafile
   /* state variables */
   char *filename;
   xmlHashTablePtr monitors;
+  xmlHashTablePtr hosts;	/* hosts of documents, by name */
 };
 
 typedef struct
@@ -79,6 +81,7 @@ metafile_open (const monfileptr mf)
   /* fill metafile struct */
   memset (mef, 0, sizeof (metafile));
   mef->mf = mf;
+  mef->hosts = xmlHashCreate (0);
   /* calculate meta filename */
   bd = monfile_get_basedir (mf);
   filename = monfile_to_metafile (monfile_get_filename (mf));
@@ -93,6 +96,8 @@ metafile_read (metafileptr mef)
 {
   FILE *f;
   time_t chk = 0;
+  int failures, until;
+  char line[512], hostname[256];
   xmlChar buf[31], *name = buf;
   if (mef->monitors != NULL)
     xmlHashFree (mef->monitors, (xmlHashDeallocator) xmlFree);
@@ -105,18 +110,33 @@ metafile_read (metafileptr mef)
       return RET_ERROR;
     }
   /* read metadata file line-by-line */
-  while (fscanf (f, "<monitor name=\"%30[^\"]\" lastcheck=\"%d\" />\n",
-		 name, (int *) &chk) == 2)
+  while (fgets (line, sizeof (line), f) != NULL)
     {
-      monmetaptr mm;
-      /* fill monmeta struct */
-      mm = (monmetaptr) xmlMalloc (sizeof (monmeta));
-      mm->seen = 0;
-      mm->lastchk = chk;
-      xmlHashAddEntry (mef->monitors, name, mm);
-      outputf (LVL_DEBUG,
-	       "[metafile] Got metadata for %s. Last check was on %s", name,
-	       ctime (&chk));
+      if (sscanf (line, "<monitor name=\"%30[^\"]\" lastcheck=\"%d\" />",
+		  name, (int *) &chk) == 2)
+	{
+	  monmetaptr mm;
+	  /* fill monmeta struct */
+	  mm = (monmetaptr) xmlMalloc (sizeof (monmeta));
+	  mm->seen = 0;
+	  mm->lastchk = chk;
+	  xmlHashAddEntry (mef->monitors, name, mm);
+	  outputf (LVL_DEBUG,
+		   "[metafile] Got metadata for %s. Last check was on %s",
+		   name, ctime (&chk));
+	}
+      else if (sscanf (line, "<host name=\"%255[^\"]\" failures=\"%d\" "
+		       "until=\"%d\" />", hostname, &failures, &until) == 3)
+	{
+	  hostptr h;
+	  /* restore circuit breaker of host */
+	  if ((h = host_get (hostname)) == NULL)
+	    continue;
+	  host_set_breaker (h, failures, (time_t) until);
+	  xmlHashAddEntry (mef->hosts, BAD_CAST host_get_name (h), h);
+	  outputf (LVL_DEBUG, "[metafile] Got metadata for host %s.\n",
+		   hostname);
+	}
     }
   fclose (f);
   return RET_OK;
@@ -129,6 +149,17 @@ write_monitor (monmetaptr mm, FILE * f, xmlChar * name)
 	   name, (int) mm->lastchk);
 }
 
+static void
+write_host (hostptr h, FILE * f, xmlChar * name)
+{
+  int failures;
+  time_t until;
+  host_get_breaker (h, &failures, &until);
+  if (failures > 0)
+    fprintf (f, "<host name=\"%.255s\" failures=\"%d\" until=\"%d\" />\n",
+	     name, failures, (int) until);
+}
+
 int
 metafile_write (metafileptr mef)
 {
@@ -141,6 +172,7 @@ metafile_write (metafileptr mef)
       return RET_ERROR;
     }
   xmlHashScan (mef->monitors, (xmlHashScanner) write_monitor, f);
+  xmlHashScan (mef->hosts, (xmlHashScanner) write_host, f);
   fclose (f);
   return RET_OK;
 }
@@ -154,9 +186,24 @@ metafile_close (metafileptr mef)
     free (mef->filename);
   if (mef->monitors != NULL)
     xmlHashFree (mef->monitors, (xmlHashDeallocator) xmlFree);
+  if (mef->hosts != NULL)
+    xmlHashFree (mef->hosts, NULL);
   xmlFree (mef);
 }
 
+/*
+ * keep state of the host of @url in metadata file @mef
+ */
+int
+metafile_add_host (metafileptr mef, const xmlChar * url)
+{
+  hostptr h;
+  if ((h = host_get ((const char *) url)) == NULL)
+    return RET_ERROR;
+  xmlHashAddEntry (mef->hosts, BAD_CAST host_get_name (h), h);
+  return RET_OK;
+}
+
 int
 monitor_set_last_check (metafileptr mef, const monitorptr m, time_t lastchk)
 {
@@ -33,6 +33,7 @@ metafileptr metafile_open (const monfileptr mf);
 int metafile_read (metafileptr mef);
 int metafile_write (metafileptr mef);
 void metafile_close (metafileptr mef);
+int metafile_add_host (metafileptr mef, const xmlChar * url);
 
 /* monitor functions */
 int monitor_set_last_check (metafileptr mef, const monitorptr m,
@@ -22,11 +22,14 @@
 #include <libxml/xmlstring.h>
 #include <libxml/parser.h>
 #include <string.h>
+#include <stdlib.h>
 #include "monfile_dtd.inc"
 #include "monfile.h"
 #include "monitor.h"
 #include "vpair.h"
 #include "basedir.h"
+#include "host.h"
+#include "mapfile.h"
 #include "global.h"
 
 struct _monfile
@@ -36,6 +39,8 @@ struct _monfile
   char *fullpath;
   xmlChar *name;
   basedirptr bd;
+  int maxconn;			/* default per-host limits */
+  double rate;
   /* state variables */
   xmlTextReaderPtr reader;
   vpairptr vp;
@@ -69,24 +74,141 @@ entity_loader (const char *url, const char *id, xmlParserCtxtPtr ctx)
   return xmlNewIOInputStream (ctx, inp, XML_CHAR_ENCODING_UTF8);
 }
 
-monfileptr
-monfile_open (const char *filename, const basedirptr bd)
+/*
+ * read per-host limits from attributes of current element, if any
+ */
+static void
+read_limits (const monfileptr mf, int *maxconn, double *rate)
 {
-  monfileptr mf;
-  if (filename == NULL || bd == NULL)
-    return NULL;
-  /* allocate monfile struct */
-  mf = (monfileptr) xmlMalloc (sizeof (monfile));
-  if (mf == NULL)
+  xmlChar *val;
+  if ((val = xmlTextReaderGetAttribute (mf->reader,
+					BAD_CAST "connections")) != NULL)
     {
-      outputf (LVL_ERR, "[monfile] Out of memory\n");
-      return NULL;
+      *maxconn = atoi ((const char *) val);
+      if (*maxconn < 1)
+	{
+	  outputf (LVL_WARN, "[monfile] Invalid number of connections '%s'\n",
+		   val);
+	  *maxconn = 0;
+	}
+      xmlFree (val);
     }
-  /* fill monfile struct */
-  memset (mf, 0, sizeof (monfile));
-  mf->filename = strdup (filename);
-  mf->fullpath = basedir_buildpath_monfile (bd, filename);
-  mf->bd = bd;
+  if ((val = xmlTextReaderGetAttribute (mf->reader, BAD_CAST "rate")) != NULL)
+    {
+      *rate = atof ((const char *) val);
+      if (*rate <= 0)
+	{
+	  outputf (LVL_WARN, "[monfile] Invalid rate '%s'\n", val);
+	  *rate = 0;
+	}
+      xmlFree (val);
+    }
+}
+
+/*
+ * read cut-off point of current <document> element, if any
+ */
+static void
+read_cutoff (const monfileptr mf, long *maxbytes, xmlChar ** until)
+{
+  xmlChar *val;
+  if ((val = xmlTextReaderGetAttribute (mf->reader,
+					BAD_CAST "maxbytes")) != NULL)
+    {
+      *maxbytes = atol ((const char *) val);
+      if (*maxbytes < 1)
+	{
+	  outputf (LVL_WARN, "[monfile] Invalid number of bytes '%s'\n", val);
+	  *maxbytes = 0;
+	}
+      xmlFree (val);
+    }
+  *until = xmlTextReaderGetAttribute (mf->reader, BAD_CAST "until");
+}
+
+/*
+ * read HTML parser options of current <document> element, from its named
+ * profile (if any), and elements whose content is always dropped
+ */
+static void
+read_profile (const monfileptr mf, int *options, xmlChar ** drop)
+{
+  xmlChar *val;
+  if ((val = xmlTextReaderGetAttribute (mf->reader, BAD_CAST "parser"))
+      != NULL)
+    {
+      *options = mapfile_get_profile (val);
+      if (*options < 0)
+	{
+	  outputf (LVL_WARN, "[monfile] Unknown parser profile '%s'\n", val);
+	  *options = 0;
+	}
+      xmlFree (val);
+    }
+  *drop = xmlTextReaderGetAttribute (mf->reader, BAD_CAST "drop");
+}
+
+/*
+ * open version pair of current <document url="..."> element
+ */
+static vpairptr
+open_document (const monfileptr mf)
+{
+  xmlChar *url, *until, *drop;
+  vpairptr vp;
+  long maxbytes = 0;
+  int maxconn = mf->maxconn, options = 0;
+  double rate = mf->rate;
+  url = xmlTextReaderGetAttribute (mf->reader, BAD_CAST "url");
+  if (url == NULL)
+    return NULL;
+  /* limit requests to the document's host */
+  read_limits (mf, &maxconn, &rate);
+  if (maxconn > 0 || rate > 0)
+    host_set_limits ((const char *) url, maxconn, rate);
+  /* fetch only beginning of document, if requested */
+  read_cutoff (mf, &maxbytes, &until);
+  /* parse both versions alike */
+  read_profile (mf, &options, &drop);
+  /* open version pair */
+  vp = vpair_open (url, maxbytes, until, options, drop, mf->bd);
+  xmlFree (url);
+  if (until != NULL)
+    xmlFree (until);
+  if (drop != NULL)
+    xmlFree (drop);
+  return vp;
+}
+
+/*
+ * announce all xpath expressions of current <document> element to its
+ * vpair beforehand, so they can be evaluated in one pass
+ */
+static void
+announce_xpaths (const monfileptr mf)
+{
+  xmlNodePtr doc, mon, cur;
+  if ((doc = xmlTextReaderExpand (mf->reader)) == NULL)
+    return;
+  for (mon = xmlFirstElementChild (doc); mon != NULL;
+       mon = xmlNextElementSibling (mon))
+    for (cur = xmlFirstElementChild (mon); cur != NULL;
+	 cur = xmlNextElementSibling (cur))
+      if (xmlStrEqual (cur->name, BAD_CAST "xpath") == 1)
+	{
+	  xmlChar *xpath = xmlNodeGetContent (cur);
+	  if (xpath != NULL)
+	    vpair_add_xpath (mf->vp, xpath);
+	  xmlSafeFree (xpath);
+	}
+}
+
+/*
+ * open reader of monfile @mf and read up to <monitorfile name="...">
+ */
+static int
+open_reader (monfileptr mf)
+{
   /* register entity loader */
   if (default_loader == NULL)
     default_loader = xmlGetExternalEntityLoader ();
@@ -96,9 +218,8 @@ monfile_open (const char *filename, const basedirptr bd)
 				 XML_PARSE_DTDATTR | XML_PARSE_DTDVALID);
   if (mf->reader == NULL)
     {
-      outputf (LVL_ERR, "[monfile] Could not open %s\n", filename);
-      monfile_close (mf);
-      return NULL;
+      outputf (LVL_ERR, "[monfile] Could not open %s\n", mf->filename);
+      return RET_ERROR;
     }
   /* register our error function */
   xmlTextReaderSetStructuredErrorHandler (mf->reader, struct_error, NULL);
@@ -111,27 +232,67 @@ monfile_open (const char *filename, const basedirptr bd)
       if (xmlTextReaderIsValid (mf->reader) != 1)
 	{
 	  outputf (LVL_ERR, "[monfile] Failed to validate!\n");
-	  monfile_close (mf);
-	  return NULL;
+	  return RET_ERROR;
 	}
       /* do we have a <monitorfile name="...">? */
       if (xmlTextReaderNodeType (mf->reader) == XML_READER_TYPE_ELEMENT &&
 	  (name = xmlTextReaderConstName (mf->reader)) != NULL &&
 	  xmlStrEqual (name, BAD_CAST "monitorfile") == 1)
 	{
-	  mf->name = xmlTextReaderGetAttribute (mf->reader, BAD_CAST "name");
+	  if (mf->name == NULL)
+	    {
+	      mf->name = xmlTextReaderGetAttribute (mf->reader,
+						    BAD_CAST "name");
+	      read_limits (mf, &mf->maxconn, &mf->rate);
+	    }
 	  break;
 	}
     }
   if (mf->name == NULL)
     {
       outputf (LVL_ERR, "[monfile] Failed to read!\n");
+      return RET_ERROR;
+    }
+  return RET_OK;
+}
+
+monfileptr
+monfile_open (const char *filename, const basedirptr bd)
+{
+  monfileptr mf;
+  if (filename == NULL || bd == NULL)
+    return NULL;
+  /* allocate monfile struct */
+  mf = (monfileptr) xmlMalloc (sizeof (monfile));
+  if (mf == NULL)
+    {
+      outputf (LVL_ERR, "[monfile] Out of memory\n");
+      return NULL;
+    }
+  /* fill monfile struct */
+  memset (mf, 0, sizeof (monfile));
+  mf->filename = strdup (filename);
+  mf->fullpath = basedir_buildpath_monfile (bd, filename);
+  mf->bd = bd;
+  if (open_reader (mf) != RET_OK)
+    {
       monfile_close (mf);
       return NULL;
     }
   return mf;
 }
 
+int
+monfile_rewind (monfileptr mf)
+{
+  /* restart reading right after <monitorfile name="..."> */
+  if (mf->reader != NULL)
+    xmlFreeTextReader (mf->reader);
+  mf->reader = NULL;
+  mf->vp = NULL;
+  return open_reader (mf);
+}
+
 int
 monfile_get_next_vpair (const monfileptr mf, vpairptr * vp)
 {
@@ -153,11 +314,7 @@ monfile_get_next_vpair (const monfileptr mf, vpairptr * vp)
 	  outputf (LVL_DEBUG, "[monfile] Got <%s...\n", name);
 	  if (xmlStrEqual (name, BAD_CAST "document") == 1)
 	    {
-	      xmlChar *url = xmlTextReaderGetAttribute (mf->reader,
-							BAD_CAST "url");
-	      /* open version pair */
-	      mf->vp = vpair_open (url, mf->bd);
-	      xmlSafeFree (url);
+	      mf->vp = open_document (mf);
 	      if (mf->vp == NULL)
 		return RET_WARNING;
 	    }
@@ -208,11 +365,7 @@ monfile_get_next_monitor (const monfileptr mf, monitorptr * mon)
 	  outputf (LVL_DEBUG, "[monfile] Got <%s ...>\n", name);
 	  if (xmlStrEqual (name, BAD_CAST "document") == 1)
 	    {
-	      xmlChar *url = xmlTextReaderGetAttribute (mf->reader,
-							BAD_CAST "url");
-	      /* open version pair */
-	      mf->vp = vpair_open (url, mf->bd);
-	      xmlSafeFree (url);
+	      mf->vp = open_document (mf);
 	      if (mf->vp == NULL)
 		{
 		  /* skip this <document>-block */
@@ -221,6 +374,7 @@ monfile_get_next_monitor (const monfileptr mf, monitorptr * mon)
 		  xmlSafeFree (lasttext);
 		  return RET_WARNING;
 		}
+	      announce_xpaths (mf);
 	    }
 	  else if (xmlStrEqual (name, BAD_CAST "monitor") == 1)
 	    {
@@ -250,26 +404,36 @@ monfile_get_next_monitor (const monfileptr mf, monitorptr * mon)
 	    {
 	      if (skipdoc)
 		break;
-	      /* complete monitor @m - ready! */
 	      xmlSafeFree (lasttext);
+	      /* skip invalid monitor */
+	      if (m == NULL)
+		return RET_WARNING;
+	      /* complete monitor @m - ready! */
 	      *mon = m;
 	      return RET_OK;
 	    }
 	  else if (xmlStrEqual (name, BAD_CAST "xpath") == 1)
 	    {
-	      if (skipdoc)
+	      if (skipdoc || m == NULL)
 		break;
-	      monitor_set_xpath (m, lasttext);
+	      /* reject invalid xpath expressions right away */
+	      if (monitor_set_xpath (m, lasttext) != RET_OK)
+		{
+		  outputf (LVL_WARN, "[monfile] Skipping monitor %s\n",
+			   monitor_get_name (m));
+		  monitor_free (m);
+		  m = NULL;
+		}
 	    }
 	  else if (xmlStrEqual (name, BAD_CAST "interval") == 1)
 	    {
-	      if (skipdoc)
+	      if (skipdoc || m == NULL)
 		break;
 	      monitor_set_interval (m, lasttext);
 	    }
 	  else if (xmlStrEqual (name, BAD_CAST "trigger") == 1)
 	    {
-	      if (skipdoc)
+	      if (skipdoc || m == NULL)
 		break;
 	      monitor_set_trigger (m, lasttext);
 	    }
@@ -32,6 +32,7 @@ typedef monfile *monfileptr;
 
 /* monfile functions */
 monfileptr monfile_open (const char *filename, const basedirptr bd);
+int monfile_rewind (monfileptr mf);
 int monfile_get_next_vpair (const monfileptr mf, vpairptr * vp);
 int monfile_get_next_monitor (const monfileptr mf, monitorptr * mon);
 void monfile_close (monfileptr mf);
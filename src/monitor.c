@@ -20,9 +20,14 @@
 
 #include <libxml/xmlstring.h>
 #include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+#include <libxml/hash.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "monitor.h"
 #include "vpair.h"
+#include "mapfile.h"
 #include "global.h"
 
 typedef enum
@@ -37,31 +42,42 @@ struct _monitor
   /* user-filled variables */
   xmlChar *name;
   xmlChar *xpath;
+  xmlXPathCompExprPtr comp;	/* compiled xpath, shared */
   unsigned long ival;
   trigger tr_type;
   double tr_prc;
   double tr_add;
   /* state variables */
   vpairptr vp;
+  int unmodified;
   xmlXPathObjectPtr oldres;
   xmlXPathObjectPtr curres;
+  xmlDocPtr olddoc;		/* nodes of @oldres read from snapshot */
 };
 
+/* compiled xpath expressions of all monitors, by expression */
+static xmlHashTablePtr exprs = NULL;
+
+
+/*
+ * evaluate @comp (compiled from @expr) on cached (@old != 0) or current
+ * version of @vp, preferably taking its result from the traversal shared
+ * by all expressions of the document
+ */
 static xmlXPathObjectPtr
-evalxpath (xmlDocPtr doc, const xmlChar * expr)
+evalxpath (vpairptr vp, int old, xmlXPathCompExprPtr comp,
+	   const xmlChar * expr)
 {
   xmlXPathContextPtr ctx;
   xmlXPathObjectPtr obj;
-  /* create xpath evaluation context */
-  ctx = xmlXPathNewContext (doc);
+  if ((obj = vpair_get_result (vp, old, expr)) != NULL)
+    return obj;
+  ctx = (old != 0 ? vpair_get_old_context (vp) : vpair_get_cur_context (vp));
   if (ctx == NULL)
-    {
-      outputf (LVL_WARN, "[monitor] Could not create xpath context!\n");
-      return NULL;
-    }
-  /* evaluate xpath expression */
-  obj = xmlXPathEvalExpression (expr, ctx);
-  xmlXPathFreeContext (ctx);
+    return NULL;
+  /* evaluate xpath expression from document root */
+  ctx->node = NULL;
+  obj = xmlXPathCompiledEval (comp, ctx);
   if (obj == NULL)
     {
       outputf (LVL_WARN, "[monitor] Could not evaluate %s!\n", expr);
@@ -70,6 +86,161 @@ evalxpath (xmlDocPtr doc, const xmlChar * expr)
   return obj;
 }
 
+/*
+ * take snapshot of result @res of @xpath in canonical form: node types,
+ * names and values, or the value itself; NULL if not representable
+ */
+static xmlNodePtr
+snapshot_result (const xmlChar * xpath, const xmlXPathObjectPtr res)
+{
+  int i;
+  char buf[32];
+  xmlNodePtr snap, node;
+  snap = xmlNewNode (NULL, BAD_CAST "result");
+  xmlSetProp (snap, BAD_CAST "xpath", xpath);
+  switch (res->type)
+    {
+    case XPATH_NODESET:
+      xmlSetProp (snap, BAD_CAST "type", BAD_CAST "nodeset");
+      for (i = 0; i < xmlXPathNodeSetGetLength (res->nodesetval); i++)
+	{
+	  xmlNodePtr cur = res->nodesetval->nodeTab[i];
+	  xmlChar *val;
+	  switch (cur->type)
+	    {
+	    case XML_ATTRIBUTE_NODE:
+	      val = xmlNodeGetContent (cur);
+	      node = xmlNewTextChild (snap, NULL, BAD_CAST "node", val);
+	      xmlSafeFree (val);
+	      xmlSetProp (node, BAD_CAST "type", BAD_CAST "attr");
+	      xmlSetProp (node, BAD_CAST "name", cur->name);
+	      break;
+	    case XML_COMMENT_NODE:
+	      node = xmlNewTextChild (snap, NULL, BAD_CAST "node", cur->content);
+	      xmlSetProp (node, BAD_CAST "type", BAD_CAST "comm");
+	      break;
+	    case XML_ELEMENT_NODE:
+	      node = xmlNewChild (snap, NULL, BAD_CAST "node", NULL);
+	      xmlSetProp (node, BAD_CAST "type", BAD_CAST "elem");
+	      xmlSetProp (node, BAD_CAST "name", cur->name);
+	      break;
+	    case XML_TEXT_NODE:
+	      node = xmlNewTextChild (snap, NULL, BAD_CAST "node", cur->content);
+	      xmlSetProp (node, BAD_CAST "type", BAD_CAST "text");
+	      break;
+	    default:
+	      xmlFreeNode (snap);
+	      return NULL;
+	    }
+	}
+      break;
+    case XPATH_STRING:
+      xmlSetProp (snap, BAD_CAST "type", BAD_CAST "string");
+      xmlNodeAddContent (snap, res->stringval);
+      break;
+    case XPATH_NUMBER:
+      xmlSetProp (snap, BAD_CAST "type", BAD_CAST "number");
+      snprintf (buf, sizeof (buf), "%.17g", res->floatval);
+      xmlNodeAddContent (snap, BAD_CAST buf);
+      break;
+    case XPATH_BOOLEAN:
+      xmlSetProp (snap, BAD_CAST "type", BAD_CAST "boolean");
+      xmlNodeAddContent (snap, BAD_CAST (res->boolval ? "true" : "false"));
+      break;
+    default:
+      xmlFreeNode (snap);
+      return NULL;
+    }
+  return snap;
+}
+
+/*
+ * rebuild result from snapshot @snap, nodes are created in new document
+ * @doc; NULL if @snap is broken
+ */
+static xmlXPathObjectPtr
+restore_result (const xmlNodePtr snap, xmlDocPtr * doc)
+{
+  xmlXPathObjectPtr res = NULL;
+  xmlChar *type, *val;
+  xmlNodePtr cur, root;
+  type = xmlGetProp (snap, BAD_CAST "type");
+  val = xmlNodeGetContent (snap);
+  if (xmlStrEqual (type, BAD_CAST "nodeset") == 1)
+    {
+      *doc = xmlNewDoc (BAD_CAST "1.0");
+      /* share names with parsed documents */
+      if (((*doc)->dict = mapfile_get_dict ()) != NULL)
+	xmlDictReference ((*doc)->dict);
+      root = xmlNewDocNode (*doc, NULL, BAD_CAST "nodes", NULL);
+      xmlDocSetRootElement (*doc, root);
+      res = xmlXPathNewNodeSet (NULL);
+      for (cur = snap->children; cur != NULL; cur = cur->next)
+	{
+	  xmlChar *kind, *name, *content;
+	  xmlNodePtr holder, node = NULL;
+	  if (cur->type != XML_ELEMENT_NODE)
+	    continue;
+	  kind = xmlGetProp (cur, BAD_CAST "type");
+	  name = xmlGetProp (cur, BAD_CAST "name");
+	  content = xmlNodeGetContent (cur);
+	  /* every node gets its own holder, so text nodes are not merged */
+	  holder = xmlNewChild (root, NULL, BAD_CAST "node", NULL);
+	  if (xmlStrEqual (kind, BAD_CAST "attr") == 1 && name != NULL)
+	    node = (xmlNodePtr) xmlNewProp (holder, name, content);
+	  else if (xmlStrEqual (kind, BAD_CAST "comm") == 1)
+	    node = xmlAddChild (holder, xmlNewDocComment (*doc, content));
+	  else if (xmlStrEqual (kind, BAD_CAST "elem") == 1 && name != NULL)
+	    node = xmlNewChild (holder, NULL, name, NULL);
+	  else if (xmlStrEqual (kind, BAD_CAST "text") == 1)
+	    node = xmlAddChild (holder, xmlNewDocText (*doc, content));
+	  xmlSafeFree (kind);
+	  xmlSafeFree (name);
+	  xmlSafeFree (content);
+	  if (node == NULL)
+	    {
+	      xmlXPathFreeObject (res);
+	      res = NULL;
+	      break;
+	    }
+	  xmlXPathNodeSetAdd (res->nodesetval, node);
+	}
+    }
+  else if (xmlStrEqual (type, BAD_CAST "string") == 1)
+    res = xmlXPathNewString (val);
+  else if (xmlStrEqual (type, BAD_CAST "number") == 1)
+    res = xmlXPathNewFloat (strtod ((const char *) val, NULL));
+  else if (xmlStrEqual (type, BAD_CAST "boolean") == 1)
+    res = xmlXPathNewBoolean (xmlStrEqual (val, BAD_CAST "true"));
+  xmlSafeFree (type);
+  xmlSafeFree (val);
+  return res;
+}
+
+/*
+ * get result of @m on cached version, preferably from its snapshot
+ */
+static int
+evaluate_old (monitorptr m)
+{
+  xmlNodePtr snap;
+  /* snapshot taken when the cached version was current */
+  if ((snap = vpair_get_snapshot (m->vp, m->xpath)) != NULL
+      && (m->oldres = restore_result (snap, &m->olddoc)) != NULL)
+    return RET_OK;
+  /* otherwise parse cached version and take snapshot for next time */
+  if (vpair_parse_old (m->vp) != RET_OK)
+    return RET_ERROR;
+  m->oldres = evalxpath (m->vp, 1, m->comp, m->xpath);
+  if (m->oldres == NULL)
+    return RET_ERROR;
+  if (vpair_is_downloaded (m->vp) == 0
+      && (snap = snapshot_result (m->xpath, m->oldres)) != NULL)
+    vpair_set_snapshot (m->vp, snap);
+  return RET_OK;
+}
+
+
 monitorptr
 monitor_new (vpairptr vp, const xmlChar * name)
 {
@@ -94,27 +265,32 @@ monitor_new (vpairptr vp, const xmlChar * name)
   return m;
 }
 
-int
-monitor_evaluate (monitorptr m)
+static int
+evaluate (monitorptr m)
 {
-  /* monitor must be non-NULL */
-  if (m == NULL)
-    return RET_ERROR;
-  /* parse corresponding vpair */
-  if (vpair_parse (m->vp) != 0)
+  /* fetch corresponding vpair */
+  if (vpair_fetch (m->vp) != RET_OK)
     {
-      outputf (LVL_NOTICE, "[monitor] Could not parse corresponding vpair\n");
+      outputf (LVL_NOTICE, "[monitor] Could not fetch corresponding vpair\n");
       return RET_ERROR;
     }
+  /* unmodified document, no need to evaluate */
+  m->unmodified = vpair_not_modified (m->vp);
+  if (m->unmodified != 0)
+    return RET_OK;
   /* old xpath result */
-  m->oldres = evalxpath (vpair_get_old_doc (m->vp), m->xpath);
-  if (m->oldres == NULL)
+  if (evaluate_old (m) != RET_OK)
     {
       outputf (LVL_WARN, "[monitor] Evaluation on old document failed!\n");
       return RET_ERROR;
     }
-  /* current xpath result */
-  m->curres = evalxpath (vpair_get_cur_doc (m->vp), m->xpath);
+  /* current xpath result, on tree shared by all monitors of document */
+  if (vpair_parse (m->vp, m->xpath) != RET_OK)
+    {
+      outputf (LVL_NOTICE, "[monitor] Could not parse corresponding vpair\n");
+      return RET_ERROR;
+    }
+  m->curres = evalxpath (m->vp, 0, m->comp, m->xpath);
   if (m->curres == NULL)
     {
       outputf (LVL_WARN, "[monitor] Evaluation on new document failed!\n");
@@ -127,9 +303,79 @@ monitor_evaluate (monitorptr m)
 	       "[monitor] Evaluation produced results of different type!\n");
       return RET_ERROR;
     }
+  /* document already updated by another monitor */
+  monitor_keep_result (m);
   return RET_OK;
 }
 
+int
+monitor_evaluate (monitorptr m)
+{
+  int ret;
+  /* monitor must be non-NULL and have a valid xpath expression */
+  if (m == NULL || m->comp == NULL)
+    return RET_ERROR;
+  /* results are allocated along with the trees they point into */
+  vpair_enter (m->vp);
+  ret = evaluate (m);
+  vpair_leave (m->vp);
+  return ret;
+}
+
+/*
+ * take snapshot of result of @xpath on current version of @vp, which has
+ * been downloaded to the cache
+ */
+static void
+keep_walker (vpairptr vp, const xmlChar * xpath)
+{
+  xmlXPathCompExprPtr comp;
+  xmlXPathObjectPtr res;
+  xmlNodePtr snap;
+  if (vpair_get_cur_context (vp) == NULL || exprs == NULL
+      || (comp = (xmlXPathCompExprPtr) xmlHashLookup (exprs, xpath)) == NULL
+      || (res = evalxpath (vp, 0, comp, xpath)) == NULL)
+    return;
+  if ((snap = snapshot_result (xpath, res)) != NULL)
+    vpair_set_snapshot (vp, snap);
+  xmlXPathFreeObject (res);
+}
+
+/*
+ * take snapshot of current result of @m, once its document has been
+ * downloaded to the cache; monitors of the same document checked before
+ * (or not due) get theirs as well
+ */
+int
+monitor_keep_result (monitorptr m)
+{
+  xmlNodePtr snap;
+  int ret = RET_ERROR;
+  if (m->curres == NULL || vpair_is_downloaded (m->vp) == 0)
+    return RET_OK;
+  vpair_enter (m->vp);
+  if ((snap = snapshot_result (m->xpath, m->curres)) != NULL)
+    ret = vpair_set_snapshot (m->vp, snap);
+  vpair_scan_snapshots (m->vp, keep_walker);
+  vpair_leave (m->vp);
+  return ret;
+}
+
+/*
+ * compare names of @n1 and @n2, names from the same dictionary are only
+ * equal if they share one pointer
+ */
+static int
+names_equal (const xmlNodePtr n1, const xmlNodePtr n2)
+{
+  if (n1->name == n2->name)
+    return 1;
+  if (n1->doc != NULL && n2->doc != NULL && n1->doc->dict != NULL
+      && n1->doc->dict == n2->doc->dict)
+    return 0;
+  return xmlStrEqual (n1->name, n2->name);
+}
+
 static int
 nodes_equal (const xmlNodePtr n1, const xmlNodePtr n2)
 {
@@ -156,7 +402,7 @@ nodes_equal (const xmlNodePtr n1, const xmlNodePtr n2)
 	return 0;
     case XML_ELEMENT_NODE:
       /* compare names */
-      if (xmlStrEqual (n1->name, n2->name) == 0)
+      if (names_equal (n1, n2) == 0)
 	return 0;
     default:
       break;
@@ -178,14 +424,12 @@ results_equal (const xmlXPathObjectPtr obj1, const xmlXPathObjectPtr obj2)
   switch (obj1->type)
     {
     case XPATH_NODESET:
-      /* results must be non-NULL */
-      if (obj1->nodesetval == obj2->nodesetval)
-	return 0;
-      if (obj1->nodesetval == NULL || obj2->nodesetval == NULL)
-	return RET_ERROR;
-      if (obj1->nodesetval->nodeNr != obj2->nodesetval->nodeNr)
+      /* empty results may come without node-set, depending on where
+         they are from */
+      if (xmlXPathNodeSetGetLength (obj1->nodesetval)
+	  != xmlXPathNodeSetGetLength (obj2->nodesetval))
 	return 1;
-      for (i = 0; i < obj1->nodesetval->nodeNr; i++)
+      for (i = 0; i < xmlXPathNodeSetGetLength (obj1->nodesetval); i++)
 	if (nodes_equal (obj1->nodesetval->nodeTab[i],
 			 obj2->nodesetval->nodeTab[i]) == 0)
 	  return 1;
@@ -207,6 +451,9 @@ int
 monitor_triggered (const monitorptr m)
 {
   double v1, v2;
+  /* unmodified document never triggers */
+  if (m != NULL && m->unmodified != 0)
+    return 0;
   /* results must be non-NULL */
   if (m == NULL || m->oldres == NULL || m->curres == NULL)
     return RET_ERROR;
@@ -262,6 +509,8 @@ monitor_free (monitorptr m)
   xmlSafeFree (m->xpath);
   if (m->oldres != NULL)
     xmlXPathFreeObject (m->oldres);
+  if (m->olddoc != NULL)
+    xmlFreeDoc (m->olddoc);
   if (m->curres != NULL)
     xmlXPathFreeObject (m->curres);
   xmlFree (m);
@@ -274,13 +523,45 @@ monitor_set_name (monitorptr m, const xmlChar * name)
   return ((m->name = xmlStrdup (name)) == NULL);
 }
 
+/*
+ * set xpath expression @xpath of @m, compiling it unless another monitor
+ * uses the same expression
+ */
 int
 monitor_set_xpath (monitorptr m, const xmlChar * xpath)
 {
+  xmlXPathCompExprPtr comp;
+  if (xpath == NULL)
+    return RET_ERROR;
+  if (exprs == NULL)
+    exprs = xmlHashCreate (0);
+  comp = (xmlXPathCompExprPtr) xmlHashLookup (exprs, xpath);
+  if (comp == NULL)
+    {
+      if ((comp = xmlXPathCompile (xpath)) == NULL)
+	{
+	  outputf (LVL_WARN, "[monitor] Invalid xpath %s\n", xpath);
+	  return RET_ERROR;
+	}
+      xmlHashAddEntry (exprs, xpath, comp);
+    }
+  m->comp = comp;
   xmlSafeFree (m->xpath);
   return ((m->xpath = xmlStrdup (xpath)) == NULL);
 }
 
+/*
+ * free compiled xpath expressions of all monitors
+ */
+void
+monitor_cleanup (void)
+{
+  if (exprs == NULL)
+    return;
+  xmlHashFree (exprs, (xmlHashDeallocator) xmlXPathFreeCompExpr);
+  exprs = NULL;
+}
+
 int
 monitor_set_interval (monitorptr m, const xmlChar * ival)
 {
@@ -32,6 +32,7 @@ typedef monitor *monitorptr;
 monitorptr monitor_new (vpairptr vp, const xmlChar * name);
 int monitor_evaluate (monitorptr m);
 int monitor_triggered (const monitorptr m);
+int monitor_keep_result (monitorptr m);
 void monitor_free (monitorptr m);
 int monitor_set_xpath (monitorptr m, const xmlChar * xpath);
 int monitor_set_interval (monitorptr m, const xmlChar * ival);
@@ -41,5 +42,6 @@ xmlXPathObjectPtr monitor_get_old_result (const monitorptr m);
 xmlXPathObjectPtr monitor_get_cur_result (const monitorptr m);
 unsigned int monitor_get_interval (const monitorptr m);
 vpairptr monitor_get_vpair (const monitorptr m);
+void monitor_cleanup (void);
 
 #endif /* __WC_MONITOR_H__ */
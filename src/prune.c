@@ -0,0 +1,717 @@
+/* $Id$ */
+/* Drop subtrees no xpath expression can see while parsing
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+/*
+ * Scripts, style sheets and inline graphics make up much of a page, but
+ * few expressions look into them. An expression, which only tests element
+ * names, attributes and text children of the elements it names, cannot
+ * tell whether the content of an element it does not name is there. Such
+ * content is dropped while parsing (the element itself stays, empty, so
+ * positions and text nodes around it are not affected). Expressions using
+ * wildcards, node(), descendant text or string values of elements might
+ * see anything, nothing is dropped for them.
+ */
+
+#include <libxml/HTMLparser.h>
+#include <libxml/SAX2.h>
+#include <libxml/hash.h>
+#include <libxml/xmlstring.h>
+#include <string.h>
+#include <ctype.h>
+#include "prune.h"
+#include "mapfile.h"
+#include "global.h"
+
+#define PRUNE_MAXDEPTH 32	/* nesting of parentheses and predicates */
+
+struct _prune
+{
+  xmlHashTablePtr always;	/* elements dropped for any expression */
+  xmlHashTablePtr names;	/* elements named by expressions */
+  int opaque;			/* some expression might see anything */
+  int version;			/* changes whenever less may be dropped */
+};
+
+/* elements, whose content is raw text to the HTML parser */
+static const char *raw[] = { "script", "style", NULL };
+
+/* elements, which hardly ever contain anything named by expressions */
+static const char *heavy[] = { "svg", NULL };
+
+/* functions, which do not depend on string values of their arguments */
+static const char *plain[] = { "last", "position", "count", "boolean", "not",
+  "true", "false", "name", "local-name", "namespace-uri", NULL
+};
+
+/* functions, which depend on string values of their arguments */
+static const char *valued[] = { "string", "concat", "starts-with",
+  "contains", "substring-before", "substring-after", "substring",
+  "string-length", "normalize-space", "translate", "number", "sum", "floor",
+  "ceiling", "round", "lang", NULL
+};
+
+/* operators, which look like names */
+static const char *logic[] = { "and", "or", NULL };
+static const char *arith[] = { "div", "mod", NULL };
+
+/* node type tests, which look like function calls */
+static const char *types[] = { "text", "node", "comment",
+  "processing-instruction", NULL
+};
+
+typedef enum
+{
+  TK_END = 0,
+  TK_NAME,			/* name test or operator name */
+  TK_FUNC,			/* function name */
+  TK_TYPE,			/* node type test */
+  TK_AXIS,			/* axis name with '::' */
+  TK_AT,
+  TK_SLASH,
+  TK_DSLASH,
+  TK_STAR,
+  TK_DOT,
+  TK_DDOT,
+  TK_OPEN,
+  TK_CLOSE,
+  TK_LBRACK,
+  TK_RBRACK,
+  TK_COMMA,
+  TK_PIPE,
+  TK_OP,			/* comparison or arithmetic operator */
+  TK_VALUE,			/* literal or number */
+  TK_OTHER
+} token;
+
+typedef enum
+{
+  OK_NONE = 0,
+  OK_ELEM,			/* elements, whose string value may be used */
+  OK_OTHER			/* attributes, text nodes or values */
+} okind;
+
+typedef enum
+{
+  LV_GROUP = 0,
+  LV_CALL,
+  LV_VALUECALL,			/* call depending on string values */
+  LV_TEST,			/* parentheses of node type test */
+  LV_PRED
+} lkind;
+
+typedef struct _level level;
+
+struct _level
+{
+  lkind kind;
+  okind operand;		/* kind of current operand */
+  int unioned;			/* elements in earlier parts of union */
+  int valued;			/* operand is compared or computed with */
+  int args;
+};
+
+typedef struct _pruner pruner;
+typedef pruner *prunerptr;
+
+struct _pruner
+{
+  pruneptr p;
+  int depth;			/* open elements */
+  int skip;			/* depth within dropped content, if any */
+  int heavy;			/* depth of open heavy element, if any */
+  int seen;			/* named element within heavy element */
+};
+
+static htmlSAXHandler handler;
+static int handler_ready = 0;
+
+static int
+in_list (const char **list, const xmlChar * name, int len)
+{
+  int i;
+  for (i = 0; list[i] != NULL; i++)
+    if ((int) strlen (list[i]) == len
+	&& xmlStrncmp (BAD_CAST list[i], name, len) == 0)
+      return 1;
+  return 0;
+}
+
+static int
+is_name_char (xmlChar c)
+{
+  return (isalnum (c) || c == '_' || c == '-' || c == '.' || c >= 0x80);
+}
+
+/*
+ * read next token of xpath expression at @pos, names are returned in
+ * @name (@len bytes)
+ */
+static token
+next_token (const xmlChar ** pos, const xmlChar ** name, int *len)
+{
+  const xmlChar *cur = *pos, *start;
+  xmlChar quote;
+  token tok = TK_OTHER;
+  while (*cur == ' ' || *cur == '\t' || *cur == '\r' || *cur == '\n')
+    cur++;
+  start = cur;
+  if (*cur == '\0')
+    tok = TK_END;
+  else if (isalpha (*cur) || *cur == '_' || *cur >= 0x80)
+    {
+      while (is_name_char (*cur)
+	     || (*cur == ':' && cur[1] != ':' && is_name_char (cur[1])))
+	cur++;
+      *name = start;
+      *len = cur - start;
+      while (*cur == ' ' || *cur == '\t' || *cur == '\r' || *cur == '\n')
+	cur++;
+      if (*cur == '(')
+	tok = (in_list (types, start, *len) ? TK_TYPE : TK_FUNC);
+      else if (*cur == ':' && cur[1] == ':')
+	{
+	  tok = TK_AXIS;
+	  cur += 2;
+	}
+      else
+	tok = TK_NAME;
+    }
+  else if (isdigit (*cur) || (*cur == '.' && isdigit (cur[1])))
+    {
+      while (isdigit (*cur) || *cur == '.')
+	cur++;
+      tok = TK_VALUE;
+    }
+  else if (*cur == '"' || *cur == '\'')
+    {
+      quote = *cur++;
+      while (*cur != '\0' && *cur != quote)
+	cur++;
+      if (*cur == quote)
+	{
+	  cur++;
+	  tok = TK_VALUE;
+	}
+    }
+  else
+    {
+      switch (*cur++)
+	{
+	case '@':
+	  tok = TK_AT;
+	  break;
+	case '/':
+	  tok = TK_SLASH;
+	  if (*cur == '/')
+	    {
+	      cur++;
+	      tok = TK_DSLASH;
+	    }
+	  break;
+	case '*':
+	  tok = TK_STAR;
+	  break;
+	case '.':
+	  tok = TK_DOT;
+	  if (*cur == '.')
+	    {
+	      cur++;
+	      tok = TK_DDOT;
+	    }
+	  break;
+	case '(':
+	  tok = TK_OPEN;
+	  break;
+	case ')':
+	  tok = TK_CLOSE;
+	  break;
+	case '[':
+	  tok = TK_LBRACK;
+	  break;
+	case ']':
+	  tok = TK_RBRACK;
+	  break;
+	case ',':
+	  tok = TK_COMMA;
+	  break;
+	case '|':
+	  tok = TK_PIPE;
+	  break;
+	case '!':
+	  if (*cur == '=')
+	    {
+	      cur++;
+	      tok = TK_OP;
+	    }
+	  break;
+	case '<':
+	case '>':
+	  if (*cur == '=')
+	    cur++;
+	  tok = TK_OP;
+	  break;
+	case '=':
+	case '+':
+	case '-':
+	  tok = TK_OP;
+	  break;
+	}
+    }
+  *pos = cur;
+  return tok;
+}
+
+/*
+ * add element @name (@len bytes) to @hash, unless there already; return
+ * 1 if added
+ */
+static int
+add_name (xmlHashTablePtr hash, const xmlChar * name, int len)
+{
+  xmlChar *key, *pos;
+  int added = 0;
+  if ((key = xmlStrndup (name, len)) == NULL)
+    return 0;
+  /* the HTML parser uses lowercase names */
+  for (pos = key; *pos != '\0'; pos++)
+    *pos = tolower (*pos);
+  if (xmlHashLookup (hash, key) == NULL)
+    added = (xmlHashAddEntry (hash, key, hash) == 0);
+  xmlFree (key);
+  return added;
+}
+
+/*
+ * end current operand of level @l, which might use string values of
+ * elements
+ */
+static int
+end_operand (level * l)
+{
+  int elems = (l->operand == OK_ELEM || l->unioned != 0);
+  if (l->operand != OK_NONE || l->unioned != 0)
+    l->args++;
+  l->operand = OK_NONE;
+  l->unioned = 0;
+  return (elems != 0 && (l->valued != 0 || l->kind == LV_VALUECALL));
+}
+
+/*
+ * analyse @xpath, adding the elements it names to @p; return 1 if it might
+ * see any part of a document
+ */
+static int
+analyse (pruneptr p, const xmlChar * xpath)
+{
+  level stack[PRUNE_MAXDEPTH];
+  level *l = stack;
+  const xmlChar *pos = xpath, *name = NULL;
+  int len = 0, opaque = 0, operand = 0, attr = 0, elems;
+  token tok, prev = TK_END;
+  lkind kind, call = LV_GROUP;
+  memset (l, 0, sizeof (level));
+  while (opaque == 0 && (tok = next_token (&pos, &name, &len)) != TK_END)
+    {
+      /* names and '*' following an operand are operators */
+      if (operand != 0 && tok == TK_NAME && in_list (logic, name, len) != 0)
+	{
+	  /* elements only tested for existence */
+	  opaque = end_operand (l);
+	  l->valued = 0;
+	  operand = 0;
+	  prev = TK_OP;
+	  continue;
+	}
+      if (operand != 0 && (tok == TK_STAR || (tok == TK_NAME
+					      && in_list (arith, name,
+							  len) != 0)))
+	tok = TK_OP;
+      switch (tok)
+	{
+	case TK_NAME:
+	  if (attr == 0)
+	    {
+	      l->operand = OK_ELEM;
+	      if (add_name (p->names, name, len) != 0)
+		p->version++;
+	    }
+	  else
+	    l->operand = OK_OTHER;
+	  attr = 0;
+	  operand = 1;
+	  break;
+	case TK_STAR:
+	  /* any attribute is fine, any element is not */
+	  if (attr == 0)
+	    opaque = 1;
+	  l->operand = OK_OTHER;
+	  attr = 0;
+	  operand = 1;
+	  break;
+	case TK_AXIS:
+	  if (len == 9 && xmlStrncmp (name, BAD_CAST "attribute", 9) == 0)
+	    {
+	      if (prev == TK_DSLASH)
+		opaque = 1;
+	      attr = 1;
+	    }
+	  else if (len == 9 && xmlStrncmp (name, BAD_CAST "namespace", 9) == 0)
+	    opaque = 1;
+	  operand = 0;
+	  break;
+	case TK_AT:
+	  /* attributes of all elements */
+	  if (prev == TK_DSLASH)
+	    opaque = 1;
+	  attr = 1;
+	  operand = 0;
+	  break;
+	case TK_TYPE:
+	  /* only text children of elements named are fine */
+	  if (len != 4 || xmlStrncmp (name, BAD_CAST "text", 4) != 0
+	      || prev == TK_DSLASH || prev == TK_AXIS || attr != 0)
+	    opaque = 1;
+	  l->operand = OK_OTHER;
+	  call = LV_TEST;
+	  operand = 0;
+	  break;
+	case TK_FUNC:
+	  if (in_list (plain, name, len) != 0)
+	    call = LV_CALL;
+	  else if (in_list (valued, name, len) != 0)
+	    call = LV_VALUECALL;
+	  else
+	    opaque = 1;
+	  operand = 0;
+	  break;
+	case TK_OPEN:
+	case TK_LBRACK:
+	  if (l == stack + PRUNE_MAXDEPTH - 1)
+	    {
+	      opaque = 1;
+	      break;
+	    }
+	  if (tok == TK_LBRACK)
+	    kind = LV_PRED;
+	  else if (prev == TK_FUNC || prev == TK_TYPE)
+	    kind = call;
+	  else
+	    kind = LV_GROUP;
+	  l++;
+	  memset (l, 0, sizeof (level));
+	  l->kind = kind;
+	  operand = 0;
+	  break;
+	case TK_CLOSE:
+	  if (l == stack || l->kind == LV_PRED)
+	    {
+	      opaque = 1;
+	      break;
+	    }
+	  kind = l->kind;
+	  elems = (l->operand == OK_ELEM || l->unioned != 0);
+	  /* string value of context node */
+	  if (kind == LV_VALUECALL && l->args == 0 && l->operand == OK_NONE
+	      && l->unioned == 0)
+	    opaque = 1;
+	  if (end_operand (l) != 0)
+	    opaque = 1;
+	  l--;
+	  if (kind == LV_GROUP)
+	    l->operand = (elems != 0 ? OK_ELEM : OK_OTHER);
+	  else if (kind != LV_TEST)
+	    l->operand = OK_OTHER;
+	  operand = 1;
+	  break;
+	case TK_RBRACK:
+	  if (l == stack || l->kind != LV_PRED)
+	    {
+	      opaque = 1;
+	      break;
+	    }
+	  opaque = end_operand (l);
+	  l--;
+	  operand = 1;
+	  break;
+	case TK_COMMA:
+	  opaque = end_operand (l);
+	  l->valued = 0;
+	  operand = 0;
+	  break;
+	case TK_PIPE:
+	  if (l->operand == OK_ELEM)
+	    l->unioned = 1;
+	  l->operand = OK_NONE;
+	  operand = 0;
+	  break;
+	case TK_OP:
+	  /* both operands are compared or computed with */
+	  l->valued = 1;
+	  opaque = end_operand (l);
+	  l->valued = 1;
+	  operand = 0;
+	  break;
+	case TK_SLASH:
+	case TK_DSLASH:
+	  /* root node, unless followed by a step */
+	  l->operand = OK_ELEM;
+	  attr = 0;
+	  operand = 0;
+	  break;
+	case TK_DOT:
+	case TK_DDOT:
+	  l->operand = OK_ELEM;
+	  operand = 1;
+	  break;
+	case TK_VALUE:
+	  l->operand = OK_OTHER;
+	  operand = 1;
+	  break;
+	default:
+	  opaque = 1;
+	  break;
+	}
+      prev = tok;
+    }
+  if (opaque == 0 && (l != stack || end_operand (l) != 0))
+    opaque = 1;
+  return opaque;
+}
+
+/*
+ * create pruning of documents for xpath expressions yet to be added, the
+ * content of elements in @drop (names separated by blanks or commas) is
+ * always dropped
+ */
+pruneptr
+prune_new (const xmlChar * drop)
+{
+  pruneptr p;
+  const xmlChar *pos, *start;
+  p = (pruneptr) xmlMalloc (sizeof (prune));
+  if (p == NULL)
+    {
+      outputf (LVL_ERR, "[prune] Out of memory\n");
+      return NULL;
+    }
+  memset (p, 0, sizeof (prune));
+  p->names = xmlHashCreate (0);
+  for (pos = drop; pos != NULL && *pos != '\0';)
+    {
+      while (*pos == ' ' || *pos == ',' || *pos == '\t' || *pos == '\n')
+	pos++;
+      for (start = pos; *pos != '\0' && *pos != ' ' && *pos != ','
+	   && *pos != '\t' && *pos != '\n'; pos++);
+      if (pos == start)
+	continue;
+      if (p->always == NULL)
+	p->always = xmlHashCreate (0);
+      add_name (p->always, start, pos - start);
+    }
+  return p;
+}
+
+void
+prune_free (pruneptr p)
+{
+  if (p == NULL)
+    return;
+  if (p->always != NULL)
+    xmlHashFree (p->always, NULL);
+  if (p->names != NULL)
+    xmlHashFree (p->names, NULL);
+  xmlFree (p);
+}
+
+/*
+ * add xpath expression @xpath, which is to see the same as on the full tree
+ */
+int
+prune_add_xpath (pruneptr p, const xmlChar * xpath)
+{
+  if (p->opaque != 0)
+    return RET_OK;
+  if (analyse (p, xpath) != 0)
+    {
+      outputf (LVL_DEBUG, "[prune] Cannot prune for %s\n", xpath);
+      p->opaque = 1;
+      p->version++;
+    }
+  return RET_OK;
+}
+
+/*
+ * get version of what is dropped, documents parsed with an older version
+ * might lack what expressions added since then need
+ */
+int
+prune_get_version (const pruneptr p)
+{
+  return p->version;
+}
+
+static int
+is_candidate (const pruneptr p, const char **list, const xmlChar * name)
+{
+  return (p->opaque == 0 && in_list (list, name, xmlStrlen (name)) != 0
+	  && xmlHashLookup (p->names, name) == NULL);
+}
+
+/*
+ * tell whether prune_read_html() drops content regardless of expressions,
+ * which changes what they see
+ */
+int
+prune_drops_always (const pruneptr p)
+{
+  return (p->always != NULL && xmlHashSize (p->always) > 0);
+}
+
+/*
+ * tell whether prune_read_html() would drop anything at all
+ */
+int
+prune_is_active (const pruneptr p)
+{
+  int i;
+  if (p->always != NULL && xmlHashSize (p->always) > 0)
+    return 1;
+  for (i = 0; raw[i] != NULL; i++)
+    if (is_candidate (p, raw, BAD_CAST raw[i]) != 0)
+      return 1;
+  for (i = 0; heavy[i] != NULL; i++)
+    if (is_candidate (p, heavy, BAD_CAST heavy[i]) != 0)
+      return 1;
+  return 0;
+}
+
+static void
+prune_start_element (void *ctx, const xmlChar * name,
+		     const xmlChar ** atts)
+{
+  htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr) ctx;
+  prunerptr pr = (prunerptr) ctxt->_private;
+  /* content of dropped elements is never built */
+  if (pr->skip != 0)
+    {
+      pr->skip++;
+      return;
+    }
+  mapfile_start_element (ctx, name, atts);
+  pr->depth++;
+  if (pr->heavy != 0 && xmlHashLookup (pr->p->names, name) != NULL)
+    pr->seen = 1;
+  if ((pr->p->always != NULL && xmlHashLookup (pr->p->always, name) != NULL)
+      || is_candidate (pr->p, raw, name) != 0)
+    pr->skip = 1;
+  else if (pr->heavy == 0 && is_candidate (pr->p, heavy, name) != 0)
+    {
+      pr->heavy = pr->depth;
+      pr->seen = 0;
+    }
+}
+
+static void
+prune_end_element (void *ctx, const xmlChar * name)
+{
+  htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr) ctx;
+  prunerptr pr = (prunerptr) ctxt->_private;
+  xmlNodePtr node = ctxt->node, cur;
+  if (pr->skip > 1)
+    {
+      pr->skip--;
+      return;
+    }
+  pr->skip = 0;
+  xmlSAX2EndElement (ctx, name);
+  /* heavy elements are built, but dropped unless they named anything */
+  if (pr->heavy != 0 && pr->heavy == pr->depth)
+    {
+      pr->heavy = 0;
+      if (pr->seen == 0 && node != NULL && node->type == XML_ELEMENT_NODE
+	  && xmlStrEqual (node->name, name) == 1)
+	{
+	  while ((cur = node->children) != NULL)
+	    {
+	      xmlUnlinkNode (cur);
+	      xmlFreeNode (cur);
+	    }
+	  /* do not let the parser append text to a node it does not know */
+	  ctxt->nodelen = ctxt->nodemem = 0;
+	}
+    }
+  pr->depth--;
+}
+
+static void
+prune_characters (void *ctx, const xmlChar * ch, int len)
+{
+  if (((prunerptr) ((htmlParserCtxtPtr) ctx)->_private)->skip == 0)
+    xmlSAX2Characters (ctx, ch, len);
+}
+
+static void
+prune_cdata_block (void *ctx, const xmlChar * value, int len)
+{
+  if (((prunerptr) ((htmlParserCtxtPtr) ctx)->_private)->skip == 0)
+    xmlSAX2CDataBlock (ctx, value, len);
+}
+
+static void
+prune_comment (void *ctx, const xmlChar * value)
+{
+  if (((prunerptr) ((htmlParserCtxtPtr) ctx)->_private)->skip == 0)
+    xmlSAX2Comment (ctx, value);
+}
+
+static void
+prune_processing_instruction (void *ctx, const xmlChar * target,
+			      const xmlChar * data)
+{
+  if (((prunerptr) ((htmlParserCtxtPtr) ctx)->_private)->skip == 0)
+    xmlSAX2ProcessingInstruction (ctx, target, data);
+}
+
+/*
+ * parse HTML document @data (@size bytes) with HTML parser @options,
+ * dropping what no expression added to @p can see; @enc as with
+ * mapfile_read_html()
+ */
+xmlDocPtr
+prune_read_html (const pruneptr p, const char *data, size_t size,
+		 const char *url, int options, xmlCharEncoding enc)
+{
+  pruner pr;
+  memset (&pr, 0, sizeof (pruner));
+  pr.p = p;
+  if (handler_ready == 0)
+    {
+      xmlSAX2InitHtmlDefaultSAXHandler (&handler);
+      handler.startElement = prune_start_element;
+      handler.endElement = prune_end_element;
+      handler.characters = prune_characters;
+      handler.cdataBlock = prune_cdata_block;
+      handler.comment = prune_comment;
+      handler.processingInstruction = prune_processing_instruction;
+      handler_ready = 1;
+    }
+  return mapfile_read_html_sax (data, size, url, options, enc, &handler,
+				&pr);
+}
@@ -0,0 +1,42 @@
+/* $Id$ */
+/* Drop subtrees no xpath expression can see while parsing
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifndef __WC_PRUNE_H__
+#define __WC_PRUNE_H__
+
+#include <stddef.h>
+#include <libxml/tree.h>
+#include <libxml/encoding.h>
+
+typedef struct _prune prune;
+typedef prune *pruneptr;
+
+/* prune functions */
+pruneptr prune_new (const xmlChar * drop);
+void prune_free (pruneptr p);
+int prune_add_xpath (pruneptr p, const xmlChar * xpath);
+int prune_get_version (const pruneptr p);
+int prune_is_active (const pruneptr p);
+int prune_drops_always (const pruneptr p);
+xmlDocPtr prune_read_html (const pruneptr p, const char *data, size_t size,
+			   const char *url, int options,
+			   xmlCharEncoding enc);
+
+#endif /* __WC_PRUNE_H__ */
@@ -25,9 +25,29 @@
 
 #include <stdio.h>
 
+#if defined(HAVE_STDINT_H)
+#include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+#include <inttypes.h>
+#else
+typedef unsigned int uint32_t;
+#endif /* HAVE_STDINT_H */
+
 #define SHA1_DIGEST_SIZE 20
 
-struct sha1_ctx;
+/* Structure to save state of computation between the single steps.  */
+struct sha1_ctx
+{
+  uint32_t A;
+  uint32_t B;
+  uint32_t C;
+  uint32_t D;
+  uint32_t E;
+
+  uint32_t total[2];
+  uint32_t buflen;
+  uint32_t buffer[32];
+};
 
 /* Initialize structure containing state of computation. */
 void sha1_init_ctx (struct sha1_ctx *ctx);
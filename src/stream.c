@@ -0,0 +1,219 @@
+/* $Id$ */
+/* Evaluate simple xpath expressions while parsing, without a full tree
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+/*
+ * Downward paths like /html/body//div/text() only depend on the names
+ * of an element and its ancestors. While parsing, elements matching such
+ * a path are kept along with their subtree and their ancestors, all the
+ * rest is dropped as soon as it is complete. Evaluating the xpath
+ * expression on what is left yields the same result as on the full tree.
+ * Paths of several expressions are matched at once, joined by '|'.
+ */
+
+#include <libxml/HTMLparser.h>
+#include <libxml/SAX2.h>
+#include <libxml/xmlstring.h>
+#include <string.h>
+#include "stream.h"
+#include "mapfile.h"
+#include "global.h"
+
+typedef struct _streamer streamer;
+typedef streamer *streamerptr;
+
+struct _streamer
+{
+  xmlStreamCtxtPtr stream;
+  int depth;			/* open elements */
+  int inside;			/* depth of open matching element, if any */
+};
+
+/* functions, whose result only depends on the nodes of their argument */
+static const char *wrappers[] = { "count(", "string(", NULL };
+
+/* steps selecting text nodes within matching elements */
+static const char *suffixes[] = { "//text()", "/text()", NULL };
+
+static htmlSAXHandler handler;
+static int handler_ready = 0;
+
+/*
+ * get path of elements, @xpath depends on; NULL if @xpath cannot be
+ * streamed
+ */
+xmlChar *
+stream_path (const xmlChar * xpath)
+{
+  int i, len, n;
+  xmlChar *path, *pos;
+  xmlPatternPtr pat;
+  if ((path = xmlStrdup (xpath)) == NULL)
+    return NULL;
+  len = xmlStrlen (path);
+  /* unwrap function call */
+  for (i = 0; wrappers[i] != NULL; i++)
+    {
+      n = strlen (wrappers[i]);
+      if (len > n && xmlStrncmp (path, BAD_CAST wrappers[i], n) == 0
+	  && path[len - 1] == ')')
+	{
+	  len -= n + 1;
+	  memmove (path, path + n, len);
+	  path[len] = '\0';
+	  break;
+	}
+    }
+  /* strip text step, matching elements are kept with their text */
+  for (i = 0; suffixes[i] != NULL; i++)
+    {
+      n = strlen (suffixes[i]);
+      if (len > n && xmlStrEqual (path + len - n, BAD_CAST suffixes[i]))
+	{
+	  len -= n;
+	  path[len] = '\0';
+	  break;
+	}
+    }
+  /* no predicates or functions left */
+  if (strpbrk ((const char *) path, "[]()") != NULL)
+    {
+      xmlFree (path);
+      return NULL;
+    }
+  /* only absolute paths, relative patterns would match anywhere */
+  for (pos = path; pos != NULL; pos = (xmlChar *) xmlStrchr (pos, '|'))
+    {
+      while (*pos == '|' || *pos == ' ')
+	pos++;
+      if (*pos != '/')
+	{
+	  xmlFree (path);
+	  return NULL;
+	}
+    }
+  if ((pat = stream_compile (path)) == NULL)
+    {
+      xmlFree (path);
+      return NULL;
+    }
+  xmlFreePattern (pat);
+  return path;
+}
+
+/*
+ * compile @path (paths of stream_path() joined by '|') for
+ * stream_read_html(), NULL if it cannot be streamed
+ */
+xmlPatternPtr
+stream_compile (const xmlChar * path)
+{
+  xmlPatternPtr pat;
+  pat = xmlPatterncompile (path, NULL, 0, NULL);
+  if (pat != NULL && xmlPatternStreamable (pat) != 1)
+    {
+      xmlFreePattern (pat);
+      pat = NULL;
+    }
+  return pat;
+}
+
+static void
+stream_start_element (void *ctx, const xmlChar * name,
+		      const xmlChar ** atts)
+{
+  htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr) ctx;
+  streamerptr s = (streamerptr) ctxt->_private;
+  int i, match;
+  mapfile_start_element (ctx, name, atts);
+  s->depth++;
+  match = xmlStreamPush (s->stream, name, NULL);
+  for (i = 0; atts != NULL && atts[i] != NULL; i += 2)
+    {
+      if (xmlStreamPushAttr (s->stream, atts[i], NULL) == 1)
+	match = 1;
+      xmlStreamPop (s->stream);
+    }
+  if (match == 1 && s->inside == 0)
+    s->inside = s->depth;
+}
+
+static void
+stream_end_element (void *ctx, const xmlChar * name)
+{
+  htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr) ctx;
+  streamerptr s = (streamerptr) ctxt->_private;
+  xmlNodePtr node = ctxt->node, cur, next;
+  int keep;
+  xmlStreamPop (s->stream);
+  xmlSAX2EndElement (ctx, name);
+  /* matching elements are kept along with their subtree */
+  keep = (s->inside != 0);
+  if (s->inside == s->depth)
+    s->inside = 0;
+  s->depth--;
+  if (keep != 0 || node == NULL || node->type != XML_ELEMENT_NODE
+      || xmlStrEqual (node->name, name) == 0)
+    return;
+  /* other elements are only kept as ancestors of matching ones */
+  for (cur = node->children; cur != NULL; cur = next)
+    {
+      next = cur->next;
+      if (cur->type == XML_ELEMENT_NODE)
+	continue;
+      xmlUnlinkNode (cur);
+      xmlFreeNode (cur);
+    }
+  if (node->children == NULL)
+    {
+      xmlUnlinkNode (node);
+      xmlFreeNode (node);
+    }
+  /* do not let the parser append text to a node it does not know */
+  ctxt->nodelen = ctxt->nodemem = 0;
+}
+
+/*
+ * parse HTML document @data (@size bytes) with HTML parser @options,
+ * keeping only what is needed to evaluate the xpath expressions, whose
+ * paths are compiled to @pat; @enc as with mapfile_read_html()
+ */
+xmlDocPtr
+stream_read_html (const char *data, size_t size, const char *url,
+		  int options, xmlCharEncoding enc, xmlPatternPtr pat)
+{
+  streamer s;
+  xmlDocPtr doc;
+  memset (&s, 0, sizeof (streamer));
+  if ((s.stream = xmlPatternGetStreamCtxt (pat)) == NULL)
+    return NULL;
+  if (handler_ready == 0)
+    {
+      xmlSAX2InitHtmlDefaultSAXHandler (&handler);
+      handler.startElement = stream_start_element;
+      handler.endElement = stream_end_element;
+      handler_ready = 1;
+    }
+  /* start at document root */
+  xmlStreamPush (s.stream, NULL, NULL);
+  doc = mapfile_read_html_sax (data, size, url, options, enc, &handler,
+			       &s);
+  xmlFreeStreamCtxt (s.stream);
+  return doc;
+}
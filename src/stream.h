@@ -0,0 +1,36 @@
+/* $Id$ */
+/* Evaluate simple xpath expressions while parsing, without a full tree
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifndef __WC_STREAM_H__
+#define __WC_STREAM_H__
+
+#include <stddef.h>
+#include <libxml/tree.h>
+#include <libxml/pattern.h>
+#include <libxml/encoding.h>
+
+/* stream functions */
+xmlChar *stream_path (const xmlChar * xpath);
+xmlPatternPtr stream_compile (const xmlChar * path);
+xmlDocPtr stream_read_html (const char *data, size_t size, const char *url,
+			    int options, xmlCharEncoding enc,
+			    xmlPatternPtr pat);
+
+#endif /* __WC_STREAM_H__ */
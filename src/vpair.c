@@ -24,48 +24,285 @@
 #include <libxml/HTMLparser.h>
 #include <libxml/xmlIO.h>
 #include <libxml/tree.h>
+#include <libxml/xpath.h>
 #include <string.h>
 #include <errno.h>
-#ifdef HAVE_LIBCURL
-#include <curl/curl.h>
-#endif
+#include <sys/stat.h>
 #include "global.h"
 #include "vpair.h"
+#include "fetch.h"
 #include "sha1.h"
 #include "basedir.h"
+#include "mapfile.h"
+#include "stream.h"
+#include "prune.h"
+#include "arena.h"
+#include "walk.h"
 
+typedef enum
+{
+  VS_NEW = 0,
+  VS_FETCHED,			/* current version at hand */
+  VS_PARSED,			/* current version parsed */
+  VS_UNMODIFIED,		/* nothing to parse */
+  VS_FAILED
+} vstate;
 
 struct _vpair
 {
   /* user-filled variables */
   xmlChar *url;
+  long maxbytes;		/* cut current version off early */
+  char *until;
+  int options;			/* of HTML parser, same for both versions */
+  pruneptr prune;		/* what parses of both versions may drop */
   /* state variables */
+  vstate state;
+  vstate oldstate;		/* cached version parsed on demand */
+  int downloaded;		/* cache has been updated */
+  int queued;			/* announced to fetching */
   char *cache;
-  xmlParserInputBufferPtr curbuf;
-  xmlDocPtr curdoc;
+  char *headers;		/* validators of cached version */
+  char *results;		/* snapshots of results on cached version */
+  xmlDocPtr resdoc;
+  xmlDocPtr newresdoc;		/* snapshots on downloaded version */
+  int resdirty;
+  char *etag;
+  char *lastmod;
+  char *sha1;			/* fingerprint of cached version */
+  xmlCharEncoding oldenc;	/* its encoding, as told by mapfile */
+  xmlHashTablePtr xpaths;	/* expressions evaluated on current version */
+  xmlChar *paths;		/* what they depend on, if all streamable */
+  int full;			/* some expression needs the full tree */
+  transferptr cur;		/* shared with other vpairs */
+  xmlDocPtr curdoc;		/* belongs to cur, unless parsed for vpair */
+  xmlDocPtr prunedoc;		/* parsed for vpair */
+  int streamed;			/* prunedoc holds matching nodes only */
+  int dropped;			/* prune version prunedoc was parsed with,
+				   -1 if not pruned */
   xmlDocPtr olddoc;
+  int olddropped;		/* same for olddoc, -1 if not pruned */
+  xmlListPtr stale;		/* replaced trees, results point into them */
+  xmlXPathContextPtr curctx;	/* shared by all monitors */
+  xmlXPathContextPtr oldctx;
+  walkptr curwalk;		/* answers expressions on curdoc at once */
+  walkptr oldwalk;		/* same on olddoc */
+  arenaptr arena;		/* what is parsed and evaluated for vpair */
+  xmlDictPtr dict;		/* names of its documents, in arena */
+  int entered;			/* nesting of vpair_enter() */
+  arenaptr outer;		/* entered before */
+  xmlDictPtr outerdict;
 };
 
 static char *
-url_to_cache (const xmlChar * url)
+hash_to_hex (const unsigned char *hashval, const char *ext)
 {
   int i;
-  unsigned char hashval[20];
   char *hash, *pos;
-  hash = pos = (char *) malloc (2 * 20 + 5 + 1);
-  sha1_buffer ((char *) url, strlen ((char *) url), hashval);
+  hash = pos = (char *) malloc (2 * 20 + strlen (ext) + 1);
   for (i = 0; i < 20; i++)
     {
       sprintf (pos, "%02x", hashval[i]);
       pos += 2;
     }
-  return strcat (hash, ".html");
+  return strcat (hash, ext);
+}
+
+static char *
+url_to_cache (const xmlChar * url, const char *ext)
+{
+  unsigned char hashval[20];
+  sha1_buffer ((char *) url, strlen ((char *) url), hashval);
+  return hash_to_hex (hashval, ext);
+}
+
+/*
+ * get key of cache of @vp, documents cut off early, parsed with other
+ * options or always dropping elements (@drop) are cached apart
+ */
+static xmlChar *
+cache_key (const vpairptr vp, const xmlChar * drop)
+{
+  xmlChar *key;
+  if (vp->maxbytes == 0 && vp->until == NULL && vp->options == 0
+      && drop == NULL)
+    return xmlStrdup (vp->url);
+  key = (xmlChar *) xmlMalloc (xmlStrlen (vp->url) + (vp->until ?
+							strlen (vp->until) :
+							0) + xmlStrlen (drop)
+			       + 38);
+  sprintf ((char *) key, "%s\n%ld\n%s", (const char *) vp->url,
+	   vp->maxbytes, (vp->until ? vp->until : ""));
+  if (vp->options != 0 || drop != NULL)
+    sprintf ((char *) key + xmlStrlen (key), "\n%d", vp->options);
+  if (drop != NULL)
+    sprintf ((char *) key + xmlStrlen (key), "\n%s", (const char *) drop);
+  return key;
+}
+
+static int
+stale_free_walker (const void *data, void *user)
+{
+  xmlFreeDoc ((xmlDocPtr) data);
+  return 1;
+}
+
+/*
+ * keep replaced tree @doc of @vp until it is closed, results of earlier
+ * evaluations may still point into it
+ */
+static void
+keep_stale (vpairptr vp, xmlDocPtr doc)
+{
+  if (doc == NULL)
+    return;
+  if (vp->stale == NULL)
+    vp->stale = xmlListCreate (NULL, NULL);
+  xmlListPushBack (vp->stale, doc);
+}
+
+/*
+ * read validators (ETag, Last-Modified), fingerprint and encoding of
+ * cached version of @vp
+ */
+static void
+read_validators (vpairptr vp)
+{
+  FILE *f;
+  char line[1024];
+  struct stat st;
+  /* validators are useless without cached version */
+  if (stat (vp->cache, &st) != 0)
+    return;
+  if ((f = fopen (vp->headers, "r")) != NULL)
+    {
+      while (fgets (line, sizeof (line), f) != NULL)
+	{
+	  line[strcspn (line, "\r\n")] = '\0';
+	  if (strncmp (line, "ETag: ", 6) == 0 && vp->etag == NULL)
+	    vp->etag = strdup (line + 6);
+	  else if (strncmp (line, "Last-Modified: ", 15) == 0
+		   && vp->lastmod == NULL)
+	    vp->lastmod = strdup (line + 15);
+	  else if (strncmp (line, "SHA1: ", 6) == 0 && vp->sha1 == NULL)
+	    vp->sha1 = strdup (line + 6);
+	  else if (strncmp (line, "Encoding: ", 10) == 0)
+	    vp->oldenc = mapfile_find_encoding (line + 10);
+	}
+      fclose (f);
+    }
+  /* fingerprint cached versions lacking one (written by older releases)
+     once, keeping it along with their validators */
+  if (vp->sha1 == NULL && (f = fopen (vp->cache, "rb")) != NULL)
+    {
+      unsigned char hashval[20];
+      if (sha1_stream (f, hashval) == 0)
+	vp->sha1 = hash_to_hex (hashval, "");
+      fclose (f);
+      if (vp->sha1 != NULL && (f = fopen (vp->headers, "a")) != NULL)
+	{
+	  fprintf (f, "SHA1: %s\n", vp->sha1);
+	  fclose (f);
+	}
+    }
+  outputf (LVL_DEBUG, "[vpair] Got validators %s, %s, %s\n",
+	   vp->etag ? vp->etag : "-", vp->lastmod ? vp->lastmod : "-",
+	   vp->sha1 ? vp->sha1 : "-");
+}
+
+/*
+ * write validators, fingerprint and encoding of current version of @vp
+ * along with cached version (the encoding spares checking it again when
+ * parsing the cached version)
+ */
+static int
+write_validators (vpairptr vp)
+{
+  FILE *f;
+  const char *etag, *lastmod, *sha1, *enc;
+  etag = transfer_get_etag (vp->cur);
+  lastmod = transfer_get_last_modified (vp->cur);
+  sha1 = transfer_get_sha1 (vp->cur);
+  enc = mapfile_get_encoding_name (transfer_get_encoding (vp->cur));
+  if (etag == NULL && lastmod == NULL && sha1 == NULL)
+    {
+      /* no validators, do not keep outdated ones */
+      if (remove (vp->headers) != 0 && errno != ENOENT)
+	return RET_ERROR;
+      return RET_OK;
+    }
+  if ((f = fopen (vp->headers, "w")) == NULL)
+    {
+      outputf (LVL_WARN, "[vpair] Could not open %s\n", vp->headers);
+      return RET_ERROR;
+    }
+  if (etag != NULL)
+    fprintf (f, "ETag: %s\n", etag);
+  if (lastmod != NULL)
+    fprintf (f, "Last-Modified: %s\n", lastmod);
+  if (sha1 != NULL)
+    fprintf (f, "SHA1: %s\n", sha1);
+  if (enc != NULL)
+    fprintf (f, "Encoding: %s\n", enc);
+  fclose (f);
+  return RET_OK;
+}
+
+/*
+ * leave arena of @vp (if entered) for what is shared with other vpairs;
+ * returns what to pass to resume()
+ */
+static int
+suspend (vpairptr vp)
+{
+  int entered = vp->entered;
+  if (entered > 0)
+    {
+      vp->entered = 1;
+      vpair_leave (vp);
+    }
+  return entered;
+}
+
+static void
+resume (vpairptr vp, int entered)
+{
+  if (entered > 0)
+    {
+      vpair_enter (vp);
+      vp->entered = entered;
+    }
+}
+
+/*
+ * fetch current version of @vp (if necessary)
+ */
+static int
+fetch_current (vpairptr vp)
+{
+  int entered;
+  if (vp->cur != NULL)
+    return RET_OK;
+  outputf (LVL_INFO, "[vpair] Fetching document %s\n", vp->url);
+  entered = suspend (vp);
+  vp->cur = fetch_document ((char *) vp->url, vp->etag, vp->lastmod,
+			    vp->sha1, vp->cache, vp->maxbytes, vp->until,
+			    vp->options);
+  resume (vp, entered);
+  if (vp->cur == NULL)
+    {
+      outputf (LVL_WARN, "[vpair] Could not open %s\n", vp->url);
+      return RET_ERROR;
+    }
+  return RET_OK;
 }
 
 vpairptr
-vpair_open (const xmlChar * url, const basedirptr bd)
+vpair_open (const xmlChar * url, long maxbytes, const xmlChar * until,
+	    int options, const xmlChar * drop, const basedirptr bd)
 {
   char *filename = NULL;
+  xmlChar *key;
   vpairptr vp;
   /* allocate vpair struct */
   vp = (vpairptr) xmlMalloc (sizeof (vpair));
@@ -76,105 +313,552 @@ vpair_open (const xmlChar * url, const basedirptr bd)
     }
   /* fill vpair struct */
   memset (vp, 0, sizeof (vpair));
+  vp->oldenc = XML_CHAR_ENCODING_ERROR;
   vp->url = xmlStrdup (url);
+  vp->maxbytes = maxbytes;
+  if (until != NULL)
+    vp->until = strdup ((const char *) until);
+  vp->options = options;
+  /* without an arena, everything comes from the heap as usual */
+  vp->arena = arena_new ();
+  if ((vp->prune = prune_new (drop)) == NULL)
+    {
+      vpair_close (vp);
+      return NULL;
+    }
   outputf (LVL_DEBUG, "[vpair] Using current document %s\n", vp->url);
   /* calculate cache filename */
-  filename = url_to_cache (vp->url);
+  key = cache_key (vp, drop);
+  filename = url_to_cache (key, ".html");
   vp->cache = basedir_buildpath_cache (bd, filename);
   outputf (LVL_DEBUG, "[vpair] Using old document %s\n", vp->cache);
   free (filename);
+  filename = url_to_cache (key, ".hdr");
+  vp->headers = basedir_buildpath_cache (bd, filename);
+  free (filename);
+  filename = url_to_cache (key, ".res");
+  vp->results = basedir_buildpath_cache (bd, filename);
+  free (filename);
+  xmlFree (key);
+  read_validators (vp);
   return vp;
 }
 
-#ifdef HAVE_LIBCURL
-static size_t
-curl2libxml_writer (void *ptr, size_t size, size_t nmemb, void *stream)
+/*
+ * allocate what is created for @vp from its arena until vpair_leave(),
+ * calls nest; none of it may outlive @vp
+ */
+void
+vpair_enter (vpairptr vp)
 {
-  xmlParserInputBufferPtr buf = (xmlParserInputBufferPtr) stream;
-  if (buf == NULL)
-    return -1;
-  return xmlParserInputBufferPush (buf, size * nmemb, (const char *) ptr);
+  xmlDictPtr shared;
+  if (vp->arena == NULL || vp->entered++ > 0)
+    return;
+  /* created outside of any arena */
+  shared = mapfile_get_dict ();
+  vp->outer = arena_enter (vp->arena);
+  /* names new to the shared dictionary go to one in the arena */
+  if (vp->dict == NULL && shared != NULL
+      && (vp->dict = xmlDictCreateSub (shared)) != NULL)
+    /* dropped along with the arena, the shared one outlives it anyway */
+    xmlDictFree (shared);
+  vp->outerdict = mapfile_set_dict (vp->dict);
 }
-#endif
 
-static xmlParserInputBufferPtr
-read_into_buffer (const char *filename)
+void
+vpair_leave (vpairptr vp)
 {
-  xmlParserInputBufferPtr buf;
-#ifdef HAVE_LIBCURL
-  CURL *curl;
-  CURLcode res;
+  if (vp->arena == NULL || --vp->entered > 0)
+    return;
+  /* libxml2 keeps the last error beyond, do not leave it in the arena */
+  xmlResetLastError ();
+  mapfile_set_dict (vp->outerdict);
+  arena_enter (vp->outer);
+}
 
-  /* open document */
-  buf = xmlAllocParserInputBuffer (XML_CHAR_ENCODING_NONE);
+/*
+ * queue current version of @vp for fetching, announcing @vp as one of its
+ * users (once for all monitors)
+ */
+int
+vpair_prefetch (vpairptr vp)
+{
+  if (vp->queued++ > 0)
+    return RET_OK;
+  outputf (LVL_DEBUG, "[vpair] Queueing document %s\n", vp->url);
+  return fetch_queue ((char *) vp->url, vp->etag, vp->lastmod, vp->sha1,
+		      vp->cache, vp->maxbytes, vp->until, vp->options);
+}
 
-  /* read document */
-  if ((curl = curl_easy_init ()) == NULL)
+/*
+ * fetch current version of @vp, once for all monitors (or fail once)
+ */
+int
+vpair_fetch (vpairptr vp)
+{
+  if (vp->state == VS_FAILED)
+    return RET_ERROR;
+  if (vp->state != VS_NEW)
+    return RET_OK;
+  vp->state = VS_FAILED;
+  /* read current document (and keep in memory) */
+  if (fetch_current (vp) != RET_OK)
+    return RET_ERROR;
+  /* nothing to parse, if document has not changed since caching */
+  if (vpair_not_modified (vp) != 0)
     {
-      outputf (LVL_ERR, "[vpair] Unable to initialize curl\n");
-      return NULL;
+      outputf (LVL_INFO, "[vpair] Document %s not modified\n", vp->url);
+      vp->state = VS_UNMODIFIED;
+      return RET_OK;
     }
-  curl_easy_setopt (curl, CURLOPT_NOPROGRESS, 1);
-  curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, &curl2libxml_writer);
-  curl_easy_setopt (curl, CURLOPT_WRITEDATA, buf);
-  curl_easy_setopt (curl, CURLOPT_URL, filename);
-  res = curl_easy_perform (curl);
-  curl_easy_cleanup (curl);
-#else
-  int read;
-
-  /* open document */
-  if ((buf =
-       xmlParserInputBufferCreateFilename (filename,
-					   XML_CHAR_ENCODING_NONE)) == NULL)
-    {
-      outputf (LVL_WARN, "[vpair] Could not open %s\n", filename);
-      return NULL;
+  vp->state = VS_FETCHED;
+  return RET_OK;
+}
+
+/*
+ * announce xpath expression @xpath to be evaluated on current version of
+ * @vp, all expressions are answered by one parse
+ */
+int
+vpair_add_xpath (vpairptr vp, const xmlChar * xpath)
+{
+  xmlChar *path;
+  if (vp->xpaths == NULL)
+    vp->xpaths = xmlHashCreate (0);
+  if (xmlHashLookup (vp->xpaths, xpath) != NULL)
+    return RET_OK;
+  xmlHashAddEntry (vp->xpaths, xpath, vp);
+  prune_add_xpath (vp->prune, xpath);
+  /* too late for what has been parsed already */
+  if (vp->state == VS_PARSED)
+    vp->full = 1;
+  if (vp->full != 0)
+    return RET_OK;
+  if ((path = stream_path (xpath)) == NULL)
+    {
+      outputf (LVL_DEBUG, "[vpair] Cannot stream %s\n", xpath);
+      vp->full = 1;
+      return RET_OK;
     }
-  /* read document */
-  while ((read = xmlParserInputBufferRead (buf, 2048)) > 0);
-  if (read < 0)
+  /* same path is matched only once */
+  if (vp->paths == NULL)
+    vp->paths = path;
+  else
     {
-      outputf (LVL_WARN, "[vpair] Error reading %s\n", filename);
-      xmlFreeParserInputBuffer (buf);
-      return NULL;
+      xmlChar *pos = vp->paths;
+      int len = xmlStrlen (path), found = 0;
+      for (; pos != NULL; pos = (xmlChar *) xmlStrchr (pos, '|'))
+	{
+	  if (*pos == '|')
+	    pos++;
+	  if (xmlStrncmp (pos, path, len) == 0
+	      && (pos[len] == '\0' || pos[len] == '|'))
+	    found = 1;
+	}
+      if (found == 0)
+	{
+	  vp->paths = xmlStrcat (vp->paths, BAD_CAST "|");
+	  vp->paths = xmlStrcat (vp->paths, path);
+	}
+      xmlFree (path);
     }
-#endif
-  return buf;
+  return RET_OK;
+}
+
+static int
+parse_current (vpairptr vp, const xmlChar * xpath)
+{
+  xmlPatternPtr pat = NULL;
+  int entered, forced, shared, parsed;
+  const char *data = NULL;
+  size_t size;
+  /* documents are parsed only once for all monitors (or fail once) */
+  if (vpair_fetch (vp) != RET_OK)
+    return RET_ERROR;
+  if (vp->state == VS_UNMODIFIED)
+    return RET_OK;
+  vpair_add_xpath (vp, xpath);
+  if (vp->state == VS_PARSED)
+    {
+      if (vp->curdoc != vp->prunedoc || (vp->streamed != 0 ? vp->full == 0
+					 : (vp->dropped < 0 || vp->dropped ==
+					    prune_get_version (vp->prune))))
+	return RET_OK;
+      /* pruned tree lacks what @xpath needs, start over */
+      xmlXPathFreeContext (vp->curctx);
+      vp->curctx = NULL;
+      walk_free (vp->curwalk);
+      vp->curwalk = NULL;
+      vp->curdoc = NULL;
+      keep_stale (vp, vp->prunedoc);
+      vp->prunedoc = NULL;
+    }
+  else if (vp->state != VS_FETCHED)
+    return RET_ERROR;
+  vp->state = VS_FAILED;
+  /* what is always dropped is dropped from both versions alike (so the
+     tree parsed while fetching does not do); other pruning and streaming
+     do not pay, if parsed already while fetching; a tree parsed with other
+     parser options does not do either */
+  forced = prune_drops_always (vp->prune);
+  shared = transfer_suits (vp->cur, vp->options);
+  parsed = (shared != 0 && transfer_is_parsed (vp->cur) != 0);
+  if (vp->full == 0 && forced == 0 && parsed == 0)
+    pat = stream_compile (vp->paths);
+  if (pat != NULL || forced != 0 || shared == 0
+      || (prune_is_active (vp->prune) != 0 && parsed == 0))
+    data = transfer_get_content (vp->cur, &size);
+  if (data != NULL && pat != NULL)
+    {
+      /* parse current document, keeping matching nodes only */
+      outputf (LVL_DEBUG, "[vpair] Streaming %s for %s\n", vp->url,
+	       vp->paths);
+      vp->prunedoc = stream_read_html (data, size, (char *) vp->url,
+				       vp->options,
+				       transfer_get_encoding (vp->cur), pat);
+      vp->streamed = 1;
+      vp->curdoc = vp->prunedoc;
+    }
+  else if (data != NULL && prune_is_active (vp->prune) == 0)
+    {
+      /* parse current document with parser options of @vp */
+      outputf (LVL_DEBUG, "[vpair] Parsing %s with options %d\n", vp->url,
+	       vp->options);
+      vp->prunedoc = mapfile_read_html (data, size, (char *) vp->url,
+					vp->options,
+					transfer_get_encoding (vp->cur));
+      vp->streamed = 0;
+      vp->dropped = -1;
+      vp->curdoc = vp->prunedoc;
+    }
+  else if (data != NULL)
+    {
+      /* parse current document, dropping what no expression can see */
+      outputf (LVL_DEBUG, "[vpair] Pruning %s\n", vp->url);
+      vp->prunedoc = prune_read_html (vp->prune, data, size,
+				      (char *) vp->url, vp->options,
+				      transfer_get_encoding (vp->cur));
+      vp->streamed = 0;
+      vp->dropped = prune_get_version (vp->prune);
+      vp->curdoc = vp->prunedoc;
+    }
+  else if (forced == 0)
+    {
+      /* parse current document (shared with other users of same document
+         and parser options) */
+      entered = suspend (vp);
+      vp->curdoc = transfer_get_doc (vp->cur, vp->options);
+      resume (vp, entered);
+    }
+  if (pat != NULL)
+    xmlFreePattern (pat);
+  if (vp->curdoc == NULL)
+    {
+      outputf (LVL_WARN, "[vpair] Could not parse %s\n", vp->url);
+      return RET_ERROR;
+    }
+  /* prepare xpath evaluation */
+  if ((vp->curctx = xmlXPathNewContext (vp->curdoc)) == NULL)
+    {
+      outputf (LVL_WARN, "[vpair] Could not create xpath context!\n");
+      return RET_ERROR;
+    }
+  vp->state = VS_PARSED;
+  return RET_OK;
 }
 
+/*
+ * parse current version of @vp for evaluating @xpath: once for all
+ * announced expressions, keeping only what they need if all of them are
+ * streamable, or dropping what none of them can see otherwise
+ */
 int
-vpair_parse (vpairptr vp)
+vpair_parse (vpairptr vp, const xmlChar * xpath)
+{
+  int ret;
+  vpair_enter (vp);
+  ret = parse_current (vp, xpath);
+  vpair_leave (vp);
+  return ret;
+}
+
+static int
+parse_old (vpairptr vp)
 {
-  /* read and parse old document (do not keep in memory) */
+  mapfileptr mp;
+  if (vp->oldstate == VS_PARSED)
+    {
+      if (vp->olddropped < 0
+	  || vp->olddropped == prune_get_version (vp->prune))
+	return RET_OK;
+      /* pruned tree lacks what expressions added since need, start over */
+      if (vp->downloaded != 0)
+	return RET_ERROR;
+      xmlXPathFreeContext (vp->oldctx);
+      vp->oldctx = NULL;
+      walk_free (vp->oldwalk);
+      vp->oldwalk = NULL;
+      keep_stale (vp, vp->olddoc);
+      vp->olddoc = NULL;
+    }
+  /* cached version may have been replaced already */
+  else if (vp->oldstate == VS_FAILED || vp->downloaded != 0)
+    return RET_ERROR;
+  vp->oldstate = VS_FAILED;
+  /* map and parse old document (do not keep in memory) */
   outputf (LVL_INFO, "[vpair] Fetching cached document %s\n", vp->cache);
-  if ((vp->olddoc = htmlReadFile (vp->cache, NULL, 0)) == NULL)
+  if ((mp = mapfile_open (vp->cache)) != NULL)
+    {
+      /* drop alike for both versions */
+      if (prune_is_active (vp->prune) != 0)
+	{
+	  vp->olddoc = prune_read_html (vp->prune, mapfile_get_data (mp),
+					mapfile_get_size (mp), vp->cache,
+					vp->options, vp->oldenc);
+	  vp->olddropped = prune_get_version (vp->prune);
+	}
+      else
+	{
+	  vp->olddoc = mapfile_read_html (mapfile_get_data (mp),
+					  mapfile_get_size (mp), vp->cache,
+					  vp->options, vp->oldenc);
+	  vp->olddropped = -1;
+	}
+      mapfile_close (mp);
+    }
+  if (vp->olddoc == NULL)
     {
       outputf (LVL_WARN, "[vpair] Could not parse %s\n", vp->cache);
       return RET_ERROR;
     }
-  /* read current document (and keep in memory) */
-  outputf (LVL_INFO, "[vpair] Fetching document %s\n", vp->url);
-  if ((vp->curbuf = read_into_buffer ((char *) vp->url)) == NULL)
+  /* prepare xpath evaluation */
+  if ((vp->oldctx = xmlXPathNewContext (vp->olddoc)) == NULL)
     {
-      outputf (LVL_WARN, "[vpair] Could not open %s\n", vp->url);
-      xmlFreeDoc (vp->olddoc);
-      vp->olddoc = NULL;
+      outputf (LVL_WARN, "[vpair] Could not create xpath context!\n");
       return RET_ERROR;
     }
-  /* parse current document */
-  if ((vp->curdoc =
-       htmlReadMemory ((char *) xmlBufferContent (vp->curbuf->buffer),
-		       xmlBufferLength (vp->curbuf->buffer),
-		       (const char *) vp->url, NULL, 0)) == NULL)
+  vp->oldstate = VS_PARSED;
+  return RET_OK;
+}
+
+/*
+ * parse cached version of @vp, needed only for results not yet snapshot
+ */
+int
+vpair_parse_old (vpairptr vp)
+{
+  int ret;
+  vpair_enter (vp);
+  ret = parse_old (vp);
+  vpair_leave (vp);
+  return ret;
+}
+
+static void
+walk_add_walker (void *payload, walkptr w, const xmlChar * xpath)
+{
+  walk_add (w, xpath);
+}
+
+/*
+ * get result of announced expression @xpath on cached (@old != 0) or
+ * current version of @vp, as parsed before; all expressions understood
+ * by walk are answered in one traversal of the tree on first call, NULL
+ * if @xpath is not among them
+ */
+xmlXPathObjectPtr
+vpair_get_result (vpairptr vp, int old, const xmlChar * xpath)
+{
+  walkptr *w = (old != 0 ? &vp->oldwalk : &vp->curwalk);
+  xmlDocPtr doc = (old != 0 ? vp->olddoc : vp->curdoc);
+  xmlXPathObjectPtr res;
+  if (doc == NULL || vp->xpaths == NULL)
+    return NULL;
+  vpair_enter (vp);
+  if (*w == NULL && (*w = walk_new ()) != NULL)
     {
-      outputf (LVL_WARN, "[vpair] Could not parse %s\n", vp->url);
-      xmlFreeParserInputBuffer (vp->curbuf);
-      vp->curbuf = NULL;
-      xmlFreeDoc (vp->olddoc);
-      vp->olddoc = NULL;
+      xmlHashScan (vp->xpaths, (xmlHashScanner) walk_add_walker, *w);
+      outputf (LVL_DEBUG, "[vpair] Walking %s for %d of %d expressions\n",
+	       (old != 0 ? vp->cache : (char *) vp->url),
+	       walk_get_count (*w), xmlHashSize (vp->xpaths));
+      walk_run (*w, doc);
+    }
+  res = walk_get_result (*w, xpath);
+  vpair_leave (vp);
+  return res;
+}
+
+/*
+ * create empty snapshots of version with fingerprint @sha1
+ */
+static xmlDocPtr
+new_snapshots (const char *sha1)
+{
+  xmlDocPtr doc;
+  xmlNodePtr root;
+  doc = xmlNewDoc (BAD_CAST "1.0");
+  root = xmlNewDocNode (doc, NULL, BAD_CAST "snapshots", NULL);
+  xmlDocSetRootElement (doc, root);
+  xmlSetProp (root, BAD_CAST "sha1", BAD_CAST sha1);
+  return doc;
+}
+
+/*
+ * find snapshot of @xpath among children of @root
+ */
+static xmlNodePtr
+find_snapshot (xmlNodePtr root, const xmlChar * xpath)
+{
+  xmlNodePtr cur;
+  for (cur = (root ? root->children : NULL); cur != NULL; cur = cur->next)
+    {
+      xmlChar *expr;
+      int found;
+      if (cur->type != XML_ELEMENT_NODE)
+	continue;
+      expr = xmlGetProp (cur, BAD_CAST "xpath");
+      found = xmlStrEqual (expr, xpath);
+      xmlSafeFree (expr);
+      if (found != 0)
+	return cur;
+    }
+  return NULL;
+}
+
+/*
+ * read snapshots of @vp, discarding those of another cached version
+ */
+static xmlNodePtr
+read_snapshots (vpairptr vp)
+{
+  xmlNodePtr root;
+  xmlChar *sha1;
+  if (vp->resdoc == NULL)
+    {
+      struct stat st;
+      if (stat (vp->results, &st) == 0)
+	vp->resdoc = xmlReadFile (vp->results, NULL, XML_PARSE_NONET);
+      if (vp->resdoc == NULL)
+	return NULL;
+    }
+  if ((root = xmlDocGetRootElement (vp->resdoc)) == NULL)
+    return NULL;
+  sha1 = xmlGetProp (root, BAD_CAST "sha1");
+  if (sha1 == NULL || vp->sha1 == NULL
+      || xmlStrEqual (sha1, BAD_CAST vp->sha1) == 0)
+    root = NULL;
+  xmlSafeFree (sha1);
+  return root;
+}
+
+/*
+ * get snapshot of result of @xpath on cached version of @vp, NULL if none
+ */
+xmlNodePtr
+vpair_get_snapshot (vpairptr vp, const xmlChar * xpath)
+{
+  xmlNodePtr snap;
+  vpair_enter (vp);
+  snap = find_snapshot (read_snapshots (vp), xpath);
+  vpair_leave (vp);
+  return snap;
+}
+
+typedef struct
+{
+  vpairptr vp;
+  xmlNodePtr root;		/* snapshots to look in */
+  vpair_snapshot_func func;	/* called for expressions lacking one */
+  int lacking;
+} snapscan;
+
+static void
+snapshot_walker (void *payload, snapscan * scan, const xmlChar * xpath)
+{
+  if (find_snapshot (scan->root, xpath) != NULL)
+    return;
+  scan->lacking++;
+  if (scan->func != NULL)
+    scan->func (scan->vp, xpath);
+}
+
+/*
+ * tell whether some expression of @vp lacks a snapshot on its cached
+ * version
+ */
+static int
+lacks_snapshots (vpairptr vp)
+{
+  snapscan scan;
+  if (vp->xpaths == NULL)
+    return 0;
+  memset (&scan, 0, sizeof (snapscan));
+  vpair_enter (vp);
+  scan.root = read_snapshots (vp);
+  vpair_leave (vp);
+  xmlHashScan (vp->xpaths, (xmlHashScanner) snapshot_walker, &scan);
+  return scan.lacking;
+}
+
+/*
+ * call @func for every expression of @vp lacking a snapshot on the
+ * version downloaded during this run
+ */
+void
+vpair_scan_snapshots (vpairptr vp, vpair_snapshot_func func)
+{
+  snapscan scan;
+  if (vp->downloaded == 0 || vp->xpaths == NULL)
+    return;
+  memset (&scan, 0, sizeof (snapscan));
+  scan.vp = vp;
+  scan.func = func;
+  if (vp->newresdoc != NULL)
+    scan.root = xmlDocGetRootElement (vp->newresdoc);
+  xmlHashScan (vp->xpaths, (xmlHashScanner) snapshot_walker, &scan);
+}
+
+/*
+ * add snapshot @snap of a result on the version cached after this run
+ * (replacing an older one of the same xpath), @snap is freed along with @vp
+ */
+int
+vpair_set_snapshot (vpairptr vp, xmlNodePtr snap)
+{
+  xmlNodePtr root, old;
+  xmlChar *xpath;
+  const char *sha1;
+  sha1 = (vp->downloaded ? transfer_get_sha1 (vp->cur) : vp->sha1);
+  /* snapshots are useless without fingerprint of cached version */
+  if (sha1 == NULL)
+    {
+      xmlFreeNode (snap);
       return RET_ERROR;
     }
+  if (vp->downloaded != 0)
+    {
+      /* snapshots of replaced version are still needed during this run */
+      if (vp->newresdoc == NULL)
+	vp->newresdoc = new_snapshots (sha1);
+      root = xmlDocGetRootElement (vp->newresdoc);
+    }
+  else if ((root = read_snapshots (vp)) == NULL)
+    {
+      /* start over */
+      if (vp->resdoc != NULL)
+	xmlFreeDoc (vp->resdoc);
+      vp->resdoc = new_snapshots (sha1);
+      root = xmlDocGetRootElement (vp->resdoc);
+    }
+  xpath = xmlGetProp (snap, BAD_CAST "xpath");
+  if ((old = find_snapshot (root, xpath)) != NULL)
+    {
+      xmlUnlinkNode (old);
+      xmlFreeNode (old);
+    }
+  xmlSafeFree (xpath);
+  xmlAddChild (root, snap);
+  vp->resdirty = 1;
   return RET_OK;
 }
 
@@ -182,17 +866,38 @@ int
 vpair_download (vpairptr vp)
 {
   int written;
+  const char *data;
+  size_t size;
   xmlOutputBufferPtr output;
+  /* cache is updated only once for all monitors */
+  if (vp->downloaded != 0)
+    return RET_OK;
   /* read current document (if necessary) */
-  if (vp->curbuf == NULL)
+  if (fetch_current (vp) != RET_OK)
+    return RET_ERROR;
+  /* cached version is still up to date */
+  if (vpair_not_modified (vp) != 0)
     {
-      outputf (LVL_INFO, "[vpair] Fetching document %s\n", vp->url);
-      if ((vp->curbuf = read_into_buffer ((char *) vp->url)) == NULL)
-	{
-	  outputf (LVL_WARN, "[vpair] Could not open %s\n", vp->url);
-	  return RET_ERROR;
-	}
+      outputf (LVL_INFO, "[vpair] Document %s not modified, keeping %s\n",
+	       vp->url, vp->cache);
+      /* validators may change along with unchanged content */
+      if (transfer_get_status (vp->cur) != 304
+	  && write_validators (vp) != RET_OK)
+	outputf (LVL_WARN, "[vpair] Error writing to %s\n", vp->headers);
+      return RET_OK;
     }
+  /* document must have been kept in memory */
+  if ((data = transfer_get_content (vp->cur, &size)) == NULL)
+    {
+      outputf (LVL_WARN, "[vpair] Document %s not kept in memory\n",
+	       vp->url);
+      return RET_ERROR;
+    }
+  /* monitors still to be checked need the version about to be replaced,
+     unless they find snapshots of their results on it */
+  if ((vp->state == VS_FETCHED || vp->state == VS_PARSED)
+      && vp->oldstate != VS_PARSED && lacks_snapshots (vp) != 0)
+    vpair_parse_old (vp);
   /* open cache */
   if ((output = xmlOutputBufferCreateFilename (vp->cache, NULL, 0)) == NULL)
     {
@@ -200,9 +905,7 @@ vpair_download (vpairptr vp)
       return RET_ERROR;
     }
   /* write current document to cache */
-  written =
-    xmlOutputBufferWrite (output, xmlBufferLength (vp->curbuf->buffer),
-			  (char *) xmlBufferContent (vp->curbuf->buffer));
+  written = xmlOutputBufferWrite (output, (int) size, data);
   /* close cache */
   xmlOutputBufferClose (output);
   if (written == -1)
@@ -210,8 +913,11 @@ vpair_download (vpairptr vp)
       outputf (LVL_WARN, "[vpair] Error writing to %s\n", vp->cache);
       return RET_ERROR;
     }
+  if (write_validators (vp) != RET_OK)
+    outputf (LVL_WARN, "[vpair] Error writing to %s\n", vp->headers);
   outputf (LVL_INFO, "[vpair] Successfully downloaded %s to %s\n",
 	   vp->url, vp->cache);
+  vp->downloaded = 1;
   return RET_OK;
 }
 
@@ -223,6 +929,10 @@ vpair_remove (vpairptr vp)
       outputf (LVL_WARN, "[vpair] Could not remove %s\n", vp->cache);
       return RET_ERROR;
     }
+  if (remove (vp->headers) != 0 && errno != ENOENT)
+    outputf (LVL_WARN, "[vpair] Could not remove %s\n", vp->headers);
+  if (remove (vp->results) != 0 && errno != ENOENT)
+    outputf (LVL_WARN, "[vpair] Could not remove %s\n", vp->results);
   outputf (LVL_INFO, "[vpair] Successfully removed %s\n", vp->cache);
   return RET_OK;
 }
@@ -230,16 +940,54 @@ vpair_remove (vpairptr vp)
 void
 vpair_close (vpairptr vp)
 {
+  xmlDocPtr resdoc;
   if (vp == NULL)
     return;
-  if (vp->curbuf != NULL)
-    xmlFreeParserInputBuffer (vp->curbuf);
-  if (vp->olddoc != NULL)
-    xmlFreeDoc (vp->olddoc);
-  if (vp->curdoc != NULL)
-    xmlFreeDoc (vp->curdoc);
+  /* keep snapshots for next run */
+  resdoc = (vp->downloaded ? vp->newresdoc : vp->resdoc);
+  if (vp->resdirty != 0 && resdoc != NULL
+      && xmlSaveFormatFile (vp->results, resdoc, 1) < 0)
+    outputf (LVL_WARN, "[vpair] Error writing to %s\n", vp->results);
+  if (vp->resdoc != NULL)
+    xmlFreeDoc (vp->resdoc);
+  if (vp->newresdoc != NULL)
+    xmlFreeDoc (vp->newresdoc);
+  /* parsed trees and their contexts are dropped along with the arena */
+  if (vp->arena == NULL)
+    {
+      if (vp->oldctx != NULL)
+	xmlXPathFreeContext (vp->oldctx);
+      if (vp->curctx != NULL)
+	xmlXPathFreeContext (vp->curctx);
+      walk_free (vp->oldwalk);
+      walk_free (vp->curwalk);
+      /* current document belongs to its transfer, unless pruned */
+      if (vp->prunedoc != NULL)
+	xmlFreeDoc (vp->prunedoc);
+      if (vp->olddoc != NULL)
+	xmlFreeDoc (vp->olddoc);
+      if (vp->stale != NULL)
+	xmlListWalk (vp->stale, stale_free_walker, NULL);
+    }
+  transfer_release (vp->cur);
+  if (vp->xpaths != NULL)
+    xmlHashFree (vp->xpaths, NULL);
+  xmlSafeFree (vp->paths);
+  if (vp->stale != NULL)
+    xmlListDelete (vp->stale);
+  prune_free (vp->prune);
+  if (arena_get_size (vp->arena) > 0)
+    outputf (LVL_DEBUG, "[vpair] Releasing %lu bytes of %s\n",
+	     (unsigned long) arena_get_size (vp->arena), vp->url);
+  arena_free (vp->arena);
   xmlSafeFree (vp->url);
+  xmlSafeFree (vp->until);
   xmlSafeFree (vp->cache);
+  xmlSafeFree (vp->headers);
+  xmlSafeFree (vp->results);
+  xmlSafeFree (vp->etag);
+  xmlSafeFree (vp->lastmod);
+  xmlSafeFree (vp->sha1);
   xmlSafeFree (vp);
 }
 
@@ -255,6 +1003,28 @@ vpair_get_cache (const vpairptr vp)
   return vp->cache;
 }
 
+int
+vpair_is_downloaded (const vpairptr vp)
+{
+  return vp->downloaded;
+}
+
+/*
+ * check if current version of @vp equals cached version, either told by
+ * server or by identical fingerprints
+ */
+int
+vpair_not_modified (const vpairptr vp)
+{
+  const char *sha1;
+  if (vp->cur == NULL)
+    return 0;
+  if (transfer_get_status (vp->cur) == 304)
+    return 1;
+  sha1 = transfer_get_sha1 (vp->cur);
+  return (sha1 != NULL && vp->sha1 != NULL && strcmp (sha1, vp->sha1) == 0);
+}
+
 xmlDocPtr
 vpair_get_old_doc (const vpairptr vp)
 {
@@ -266,3 +1036,15 @@ vpair_get_cur_doc (const vpairptr vp)
 {
   return vp->curdoc;
 }
+
+xmlXPathContextPtr
+vpair_get_old_context (const vpairptr vp)
+{
+  return vp->oldctx;
+}
+
+xmlXPathContextPtr
+vpair_get_cur_context (const vpairptr vp)
+{
+  return vp->curctx;
+}
@@ -23,20 +23,40 @@
 
 #include <libxml/xmlstring.h>
 #include <libxml/tree.h>
+#include <libxml/xpath.h>
 #include "basedir.h"
 
 typedef struct _vpair vpair;
 typedef vpair *vpairptr;
 
+typedef void (*vpair_snapshot_func) (vpairptr vp, const xmlChar * xpath);
+
 /* vpair functions */
-vpairptr vpair_open (const xmlChar * url, const basedirptr bd);
-int vpair_parse (vpairptr vp);
+vpairptr vpair_open (const xmlChar * url, long maxbytes,
+		     const xmlChar * until, int options,
+		     const xmlChar * drop, const basedirptr bd);
+void vpair_enter (vpairptr vp);
+void vpair_leave (vpairptr vp);
+int vpair_prefetch (vpairptr vp);
+int vpair_fetch (vpairptr vp);
+int vpair_add_xpath (vpairptr vp, const xmlChar * xpath);
+int vpair_parse (vpairptr vp, const xmlChar * xpath);
+int vpair_parse_old (vpairptr vp);
+xmlXPathObjectPtr vpair_get_result (vpairptr vp, int old,
+				    const xmlChar * xpath);
+xmlNodePtr vpair_get_snapshot (vpairptr vp, const xmlChar * xpath);
+int vpair_set_snapshot (vpairptr vp, xmlNodePtr snap);
+void vpair_scan_snapshots (vpairptr vp, vpair_snapshot_func func);
 int vpair_download (vpairptr vp);
 int vpair_remove (vpairptr vp);
 void vpair_close (vpairptr vp);
 const xmlChar *vpair_get_url (const vpairptr vp);
 const char *vpair_get_cache (const vpairptr vp);
+int vpair_is_downloaded (const vpairptr vp);
+int vpair_not_modified (const vpairptr vp);
 xmlDocPtr vpair_get_old_doc (const vpairptr vp);
 xmlDocPtr vpair_get_cur_doc (const vpairptr vp);
+xmlXPathContextPtr vpair_get_old_context (const vpairptr vp);
+xmlXPathContextPtr vpair_get_cur_context (const vpairptr vp);
 
 #endif /* __WC_VPAIR_H__ */
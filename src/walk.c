@@ -0,0 +1,677 @@
+/* $Id$ */
+/* Evaluate many simple xpath expressions in one traversal of a tree
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+/*
+ * Monitors of one document mostly use absolute location paths like
+ * /html/body//div[@class='price']/text(), many of them starting alike.
+ * Evaluated one by one, each of them walks the tree from its root. Here
+ * the steps of all such paths are merged into a tree of steps, common
+ * prefixes are shared. A single depth-first traversal of the document
+ * then carries along the steps matched by the ancestors of each node and
+ * tries the steps continuing them on it, so every node is looked at once
+ * for all expressions. Nodes are collected in document order, as xpath
+ * would return them.
+ *
+ * Understood are unions of absolute paths, optionally wrapped in count()
+ * or string(). Steps go to children ('/') or descendants ('//') and test
+ * element names or '*', with at most one predicate [@name] or
+ * [@name='value'], text() or comment(). A last step may select
+ * attributes (@name, @*). Everything else is left to libxml2.
+ */
+
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+#include <libxml/hash.h>
+#include <libxml/xmlstring.h>
+#include <string.h>
+#include <ctype.h>
+#include "walk.h"
+#include "global.h"
+
+#define WALK_STACK 64		/* initial size of stack of matched steps */
+
+typedef enum
+{
+  WK_ELEM = 0,
+  WK_TEXT,
+  WK_COMM,
+  WK_ATTR
+} wkind;
+
+typedef enum
+{
+  WF_ERROR = -1,
+  WF_NODES,			/* node-set itself */
+  WF_COUNT,			/* count() of it */
+  WF_STRING			/* string() of it */
+} wfunc;
+
+typedef struct _answer answer;
+typedef answer *answerptr;
+
+struct _answer
+{
+  wfunc func;
+  int complete;			/* all of its paths are in the tree */
+  xmlNodeSetPtr nodes;
+  xmlNodePtr last;		/* added last, so nodes are added once */
+};
+
+typedef struct _step step;
+typedef step *stepptr;
+
+struct _step
+{
+  int desc;			/* on descendants of context, after '//' */
+  wkind kind;
+  xmlChar *name;		/* NULL for any */
+  xmlChar *attr;		/* of predicate, if any */
+  xmlChar *value;		/* compared to, NULL if only present */
+  stepptr first;		/* steps continuing this one */
+  stepptr next;			/* other steps continuing the same */
+  int childs;			/* some of them on children */
+  int descs;			/* some of them on descendants */
+  int attrs;			/* some of them on attributes */
+  answerptr *ends;		/* expressions completed by this step */
+  int nends;
+};
+
+struct _walk
+{
+  step root;			/* on document node */
+  xmlHashTablePtr answers;	/* by expression */
+  int count;			/* expressions answered */
+  int done;			/* traversal has taken place */
+  stepptr *stack;		/* steps matched by ancestors of a node */
+  int top;
+  int max;
+};
+
+/* functions, whose result is taken from the node-set of their argument */
+static const char *wrappers[] = { "count(", "string(", NULL };
+static const wfunc funcs[] = { WF_COUNT, WF_STRING };
+
+static void
+step_clear (stepptr s)
+{
+  xmlSafeFree (s->name);
+  xmlSafeFree (s->attr);
+  xmlSafeFree (s->value);
+}
+
+static void
+step_free (stepptr s)
+{
+  stepptr c, next;
+  for (c = s->first; c != NULL; c = next)
+    {
+      next = c->next;
+      step_free (c);
+      xmlFree (c);
+    }
+  step_clear (s);
+  xmlSafeFree (s->ends);
+}
+
+static void
+answer_free (answerptr a)
+{
+  xmlXPathFreeNodeSet (a->nodes);
+  xmlFree (a);
+}
+
+static const xmlChar *
+skip_space (const xmlChar * p)
+{
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    p++;
+  return p;
+}
+
+/*
+ * get length of name at @p, 0 if there is none (names with prefixes or
+ * beyond ASCII are not dealt with)
+ */
+static int
+name_length (const xmlChar * p)
+{
+  int n = 0;
+  if (isalpha (p[0]) == 0 && p[0] != '_')
+    return 0;
+  while (isalnum (p[n]) != 0 || p[n] == '_' || p[n] == '-' || p[n] == '.')
+    n++;
+  return n;
+}
+
+/*
+ * parse step at @p into @st; return position after it, NULL if it is not
+ * understood
+ */
+static const xmlChar *
+parse_step (const xmlChar * p, stepptr st)
+{
+  const xmlChar *end;
+  int n;
+  if (*p == '@')
+    {
+      st->kind = WK_ATTR;
+      if (*++p == '*')
+	return p + 1;
+      if ((n = name_length (p)) == 0)
+	return NULL;
+      st->name = xmlStrndup (p, n);
+      return p + n;
+    }
+  if (*p == '*')
+    n = 1;
+  else if ((n = name_length (p)) == 0)
+    return NULL;
+  else if (p[n] == '(')
+    {
+      /* node type tests */
+      if (n == 4 && xmlStrncmp (p, BAD_CAST "text()", 6) == 0)
+	st->kind = WK_TEXT;
+      else if (n == 7 && xmlStrncmp (p, BAD_CAST "comment()", 9) == 0)
+	st->kind = WK_COMM;
+      else
+	return NULL;
+      return p + n + 2;
+    }
+  else
+    st->name = xmlStrndup (p, n);
+  st->kind = WK_ELEM;
+  p += n;
+  if (*p != '[')
+    return p;
+  /* predicate testing an attribute */
+  p = skip_space (p + 1);
+  if (*p != '@' || (n = name_length (p + 1)) == 0)
+    return NULL;
+  st->attr = xmlStrndup (p + 1, n);
+  p = skip_space (p + 1 + n);
+  if (*p == '=')
+    {
+      p = skip_space (p + 1);
+      if ((*p != '\'' && *p != '"') || (end = xmlStrchr (p + 1, *p)) == NULL)
+	return NULL;
+      st->value = xmlStrndup (p + 1, end - p - 1);
+      p = skip_space (end + 1);
+    }
+  return (*p == ']' ? p + 1 : NULL);
+}
+
+static int
+steps_equal (const stepptr s1, const stepptr s2)
+{
+  return (s1->desc == s2->desc && s1->kind == s2->kind
+	  && xmlStrEqual (s1->name, s2->name) == 1
+	  && xmlStrEqual (s1->attr, s2->attr) == 1
+	  && xmlStrEqual (s1->value, s2->value) == 1);
+}
+
+/*
+ * add step @st continuing @parent, unless there is the same one already;
+ * @st is taken over
+ */
+static stepptr
+add_step (stepptr parent, stepptr st)
+{
+  stepptr s, *pos;
+  for (pos = &parent->first; *pos != NULL; pos = &(*pos)->next)
+    if (steps_equal (*pos, st) != 0)
+      {
+	step_clear (st);
+	return *pos;
+      }
+  if ((s = (stepptr) xmlMalloc (sizeof (step))) == NULL)
+    {
+      outputf (LVL_ERR, "[walk] Out of memory\n");
+      step_clear (st);
+      return NULL;
+    }
+  memcpy (s, st, sizeof (step));
+  *pos = s;
+  if (s->kind == WK_ATTR)
+    parent->attrs = 1;
+  if (s->desc != 0)
+    parent->descs = 1;
+  else if (s->kind != WK_ATTR)
+    parent->childs = 1;
+  return s;
+}
+
+static int
+add_end (stepptr s, answerptr a)
+{
+  answerptr *ends;
+  int i;
+  for (i = 0; i < s->nends; i++)
+    if (s->ends[i] == a)
+      return RET_OK;
+  ends = (answerptr *) xmlRealloc (s->ends,
+				   (s->nends + 1) * sizeof (answerptr));
+  if (ends == NULL)
+    return RET_ERROR;
+  s->ends = ends;
+  s->ends[s->nends++] = a;
+  return RET_OK;
+}
+
+/*
+ * parse absolute path at @p, adding its steps for @a (only checking it,
+ * if @a is NULL); return position after it, NULL if it is not understood
+ */
+static const xmlChar *
+parse_path (walkptr w, const xmlChar * p, answerptr a)
+{
+  stepptr cur = &w->root;
+  step st;
+  int last = 0;
+  if (*p != '/')
+    return NULL;
+  while (*p == '/')
+    {
+      /* attributes and text nodes have no children */
+      if (last != 0)
+	return NULL;
+      memset (&st, 0, sizeof (step));
+      st.desc = (p[1] == '/');
+      p = parse_step (p + (st.desc != 0 ? 2 : 1), &st);
+      last = (st.kind != WK_ELEM);
+      if (p == NULL || a == NULL)
+	step_clear (&st);
+      else
+	cur = add_step (cur, &st);
+      if (p == NULL || cur == NULL)
+	return NULL;
+    }
+  if (a != NULL && add_end (cur, a) != RET_OK)
+    return NULL;
+  return p;
+}
+
+/*
+ * parse expression @xpath, adding its paths for @a (only checking it, if
+ * @a is NULL); return function applied to their union
+ */
+static wfunc
+parse_expr (walkptr w, const xmlChar * xpath, answerptr a)
+{
+  const xmlChar *p;
+  wfunc func = WF_NODES;
+  int i, n;
+  p = skip_space (xpath);
+  for (i = 0; wrappers[i] != NULL; i++)
+    {
+      n = strlen (wrappers[i]);
+      if (xmlStrncmp (p, BAD_CAST wrappers[i], n) == 0)
+	{
+	  func = funcs[i];
+	  p = skip_space (p + n);
+	  break;
+	}
+    }
+  for (;;)
+    {
+      if ((p = parse_path (w, p, a)) == NULL)
+	return WF_ERROR;
+      p = skip_space (p);
+      if (*p != '|')
+	break;
+      p = skip_space (p + 1);
+    }
+  if (func != WF_NODES)
+    {
+      if (*p != ')')
+	return WF_ERROR;
+      p = skip_space (p + 1);
+    }
+  return (*p == '\0' ? func : WF_ERROR);
+}
+
+walkptr
+walk_new (void)
+{
+  walkptr w;
+  w = (walkptr) xmlMalloc (sizeof (walk));
+  if (w == NULL)
+    {
+      outputf (LVL_ERR, "[walk] Out of memory\n");
+      return NULL;
+    }
+  memset (w, 0, sizeof (walk));
+  if ((w->answers = xmlHashCreate (0)) == NULL)
+    {
+      xmlFree (w);
+      return NULL;
+    }
+  return w;
+}
+
+void
+walk_free (walkptr w)
+{
+  if (w == NULL)
+    return;
+  step_free (&w->root);
+  xmlHashFree (w->answers, (xmlHashDeallocator) answer_free);
+  xmlSafeFree (w->stack);
+  xmlFree (w);
+}
+
+/*
+ * add expression @xpath to be answered by walk_run(); RET_ERROR if it
+ * is not understood and must be evaluated on its own
+ */
+int
+walk_add (walkptr w, const xmlChar * xpath)
+{
+  answerptr a;
+  wfunc func;
+  if (xmlHashLookup (w->answers, xpath) != NULL)
+    return RET_OK;
+  /* check whole expression first, so nothing is added for nothing */
+  if ((func = parse_expr (w, xpath, NULL)) == WF_ERROR)
+    {
+      outputf (LVL_DEBUG, "[walk] Cannot walk %s\n", xpath);
+      return RET_ERROR;
+    }
+  a = (answerptr) xmlMalloc (sizeof (answer));
+  if (a == NULL)
+    {
+      outputf (LVL_ERR, "[walk] Out of memory\n");
+      return RET_ERROR;
+    }
+  memset (a, 0, sizeof (answer));
+  a->func = func;
+  if ((a->nodes = xmlXPathNodeSetCreate (NULL)) == NULL
+      || xmlHashAddEntry (w->answers, xpath, a) != 0)
+    {
+      if (a->nodes != NULL)
+	xmlXPathFreeNodeSet (a->nodes);
+      xmlFree (a);
+      return RET_ERROR;
+    }
+  /* steps added before running out of memory lead to an incomplete one */
+  if (parse_expr (w, xpath, a) == WF_ERROR)
+    return RET_ERROR;
+  a->complete = 1;
+  w->count++;
+  return RET_OK;
+}
+
+/*
+ * get number of expressions answered by walk_run()
+ */
+int
+walk_get_count (const walkptr w)
+{
+  return (w != NULL ? w->count : 0);
+}
+
+static int
+push (walkptr w, stepptr s)
+{
+  stepptr *stack;
+  int max;
+  if (w->top == w->max)
+    {
+      max = (w->max == 0 ? WALK_STACK : w->max * 2);
+      stack = (stepptr *) xmlRealloc (w->stack, max * sizeof (stepptr));
+      if (stack == NULL)
+	{
+	  outputf (LVL_ERR, "[walk] Out of memory\n");
+	  return RET_ERROR;
+	}
+      w->stack = stack;
+      w->max = max;
+    }
+  w->stack[w->top++] = s;
+  return RET_OK;
+}
+
+/*
+ * is @s on stack of @w from @from on
+ */
+static int
+pushed (const walkptr w, const stepptr s, int from)
+{
+  int i;
+  for (i = from; i < w->top; i++)
+    if (w->stack[i] == s)
+      return 1;
+  return 0;
+}
+
+static void
+answer_add (answerptr a, xmlNodePtr node)
+{
+  /* several steps may complete an expression on the same node */
+  if (a->last == node)
+    return;
+  a->last = node;
+  xmlXPathNodeSetAddUnique (a->nodes, node);
+}
+
+/*
+ * does element @node have attribute @name (equal to @value, unless NULL)
+ */
+static int
+attr_test (const xmlNodePtr node, const xmlChar * name,
+	   const xmlChar * value)
+{
+  xmlAttrPtr attr;
+  xmlChar *content;
+  int ret;
+  for (attr = node->properties; attr != NULL; attr = attr->next)
+    if (attr->ns == NULL && xmlStrEqual (attr->name, name) == 1)
+      break;
+  if (attr == NULL || value == NULL)
+    return (attr != NULL);
+  /* value mostly is a single text node */
+  if (attr->children == NULL)
+    return (*value == '\0');
+  if (attr->children->next == NULL && attr->children->type == XML_TEXT_NODE)
+    return xmlStrEqual (attr->children->content, value);
+  content = xmlNodeGetContent ((xmlNodePtr) attr);
+  ret = xmlStrEqual (content != NULL ? content : BAD_CAST "", value);
+  xmlSafeFree (content);
+  return ret;
+}
+
+static int
+node_test (const stepptr s, const xmlNodePtr node)
+{
+  switch (s->kind)
+    {
+    case WK_ELEM:
+      return (node->type == XML_ELEMENT_NODE
+	      && (s->name == NULL || (node->ns == NULL
+				      && xmlStrEqual (s->name,
+						      node->name) == 1))
+	      && (s->attr == NULL || attr_test (node, s->attr, s->value)));
+    case WK_TEXT:
+      return (node->type == XML_TEXT_NODE
+	      || node->type == XML_CDATA_SECTION_NODE);
+    case WK_COMM:
+      return (node->type == XML_COMMENT_NODE);
+    default:
+      return 0;
+    }
+}
+
+/*
+ * try steps continuing @s on @node (those on descendants, if @desc),
+ * pushing matching steps to be continued in turn
+ */
+static void
+match (walkptr w, xmlNodePtr node, stepptr s, int desc, int from)
+{
+  stepptr c;
+  int i;
+  if ((desc != 0 ? s->descs : s->childs) == 0)
+    return;
+  for (c = s->first; c != NULL; c = c->next)
+    {
+      if (c->desc != desc || c->kind == WK_ATTR || node_test (c, node) == 0)
+	continue;
+      for (i = 0; i < c->nends; i++)
+	answer_add (c->ends[i], node);
+      if (c->first != NULL && pushed (w, c, from) == 0)
+	push (w, c);
+    }
+}
+
+/*
+ * try attribute steps continuing @s on @attr (those on descendants only,
+ * if @desc)
+ */
+static void
+match_attr (stepptr s, xmlAttrPtr attr, int desc)
+{
+  stepptr c;
+  int i;
+  if (s->attrs == 0)
+    return;
+  for (c = s->first; c != NULL; c = c->next)
+    if (c->kind == WK_ATTR && (desc == 0 || c->desc != 0)
+	&& (c->name == NULL
+	    || (attr->ns == NULL && xmlStrEqual (c->name, attr->name) == 1)))
+      for (i = 0; i < c->nends; i++)
+	answer_add (c->ends[i], (xmlNodePtr) attr);
+}
+
+/*
+ * visit @node and its subtree; steps matched by its parent are on the
+ * stack from @cfrom to @cto, those matched by further ancestors and
+ * continued on descendants from @dfrom to @dto
+ */
+static void
+visit (walkptr w, xmlNodePtr node, int cfrom, int cto, int dfrom, int dto)
+{
+  int i, from, to, nfrom, nto, more = 0;
+  xmlAttrPtr attr;
+  xmlNodePtr cur;
+  if (node->type != XML_ELEMENT_NODE && node->type != XML_TEXT_NODE
+      && node->type != XML_CDATA_SECTION_NODE
+      && node->type != XML_COMMENT_NODE)
+    return;
+  /* steps matched by @node itself */
+  from = w->top;
+  for (i = cfrom; i < cto; i++)
+    match (w, node, w->stack[i], 0, from);
+  for (i = dfrom; i < dto; i++)
+    match (w, node, w->stack[i], 1, from);
+  to = w->top;
+  if (node->type != XML_ELEMENT_NODE)
+    {
+      w->top = from;
+      return;
+    }
+  /* attributes follow their element in document order */
+  for (attr = node->properties; attr != NULL; attr = attr->next)
+    {
+      for (i = from; i < to; i++)
+	match_attr (w->stack[i], attr, 0);
+      for (i = dfrom; i < dto; i++)
+	match_attr (w->stack[i], attr, 1);
+    }
+  /* steps to be continued on all descendants */
+  nfrom = dfrom;
+  nto = dto;
+  for (i = from; i < to; i++)
+    if (w->stack[i]->descs != 0)
+      more = 1;
+  if (more != 0)
+    {
+      nfrom = w->top;
+      for (i = dfrom; i < dto; i++)
+	push (w, w->stack[i]);
+      for (i = from; i < to; i++)
+	if (w->stack[i]->descs != 0 && pushed (w, w->stack[i], nfrom) == 0)
+	  push (w, w->stack[i]);
+      nto = w->top;
+    }
+  /* skip subtree, if nothing below can match anything */
+  more = (nto > nfrom);
+  for (i = from; i < to; i++)
+    if (w->stack[i]->childs != 0)
+      more = 1;
+  if (more != 0)
+    for (cur = node->children; cur != NULL; cur = cur->next)
+      visit (w, cur, from, to, nfrom, nto);
+  w->top = from;
+}
+
+static void
+reset_walker (answerptr a, void *data, const xmlChar * xpath)
+{
+  a->nodes->nodeNr = 0;
+  a->last = NULL;
+}
+
+/*
+ * answer all expressions added before in one traversal of @doc
+ */
+int
+walk_run (walkptr w, xmlDocPtr doc)
+{
+  xmlNodePtr cur;
+  if (w == NULL || doc == NULL)
+    return RET_ERROR;
+  xmlHashScan (w->answers, (xmlHashScanner) reset_walker, NULL);
+  w->top = 0;
+  if (push (w, &w->root) != RET_OK)
+    return RET_ERROR;
+  /* document node matches the root step */
+  for (cur = doc->children; cur != NULL; cur = cur->next)
+    visit (w, cur, 0, 1, 0, (w->root.descs != 0));
+  w->top = 0;
+  w->done = 1;
+  return RET_OK;
+}
+
+/*
+ * get result of @xpath from walk_run(), in the form xpath would return it;
+ * NULL if @xpath has not been answered
+ */
+xmlXPathObjectPtr
+walk_get_result (walkptr w, const xmlChar * xpath)
+{
+  answerptr a;
+  if (w == NULL || w->done == 0
+      || (a = (answerptr) xmlHashLookup (w->answers, xpath)) == NULL
+      || a->complete == 0)
+    return NULL;
+  switch (a->func)
+    {
+    case WF_COUNT:
+      return xmlXPathNewFloat ((double) a->nodes->nodeNr);
+    case WF_STRING:
+      /* string value of first node */
+      if (a->nodes->nodeNr == 0)
+	return xmlXPathNewCString ("");
+      return xmlXPathWrapString (xmlXPathCastNodeToString
+				 (a->nodes->nodeTab[0]));
+    default:
+      /* copy, as every monitor frees its own */
+      return xmlXPathWrapNodeSet (xmlXPathNodeSetMerge (NULL, a->nodes));
+    }
+}
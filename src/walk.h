@@ -0,0 +1,39 @@
+/* $Id$ */
+/* Evaluate many simple xpath expressions in one traversal of a tree
+
+   Copyright (C) 2008  Marius Konitzer
+   This file is part of webchanges.
+
+   webchanges is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   webchanges is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with webchanges; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA  */
+
+#ifndef __WC_WALK_H__
+#define __WC_WALK_H__
+
+#include <libxml/xmlstring.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+
+typedef struct _walk walk;
+typedef walk *walkptr;
+
+/* walk functions */
+walkptr walk_new (void);
+void walk_free (walkptr w);
+int walk_add (walkptr w, const xmlChar * xpath);
+int walk_get_count (const walkptr w);
+int walk_run (walkptr w, xmlDocPtr doc);
+xmlXPathObjectPtr walk_get_result (walkptr w, const xmlChar * xpath);
+
+#endif /* __WC_WALK_H__ */